@@ -2,6 +2,7 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <numeric>
 #include <queue>
 #include <map>
 #include <assert.h>
@@ -11,6 +12,27 @@
 #include <math.h>
 #include <iomanip>      // std::setprecision
 #include <memory>
+#include <unordered_map>
+#include <optional>
+#include <array>
+#include <cstdint>
+#include <chrono>
+#include <climits>
+#include <functional>
+#include <memory_resource>
+#include <deque>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <atomic>
+#ifdef PACMAN_THREADS
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -50,6 +72,29 @@ auto findValue(std::unordered_map<K,V>& someMap, V value) {
 
 
 
+/// Index of a pac type: ROCK=0, PAPER=1, SCISSORS=2. Anything else (e.g. DEAD) is -1.
+/// With this ordering, type a beats type b iff a == (b+1)%3.
+int typeIndex(const string& typeId) {
+    if (typeId == "ROCK") return 0;
+    if (typeId == "PAPER") return 1;
+    if (typeId == "SCISSORS") return 2;
+    return -1;
+}
+
+/// Random-looking 64 bits for the given value of the given part (0 to 7) of a state, to be XORed into its hash.
+/// Parts: 0-4 route search states, 5 pellets, 6-7 pacs.
+uint64_t zobrist(uint64_t value, int part) {
+    uint64_t z = value * 8 + part + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+bool typeBeats(int a, int b) {
+    return a == (b + 1) % 3;
+}
+
+
 void printGrid(const vector<string>& grid) {
     for (auto& s : grid) {
         cerr << s << endl;
@@ -57,13 +102,231 @@ void printGrid(const vector<string>& grid) {
 }
 
 
+#ifdef PACMAN_COUNT_ALLOCS
+// Every heap allocation goes through here, so that each step can report how many it made. Only for profiling builds.
+atomic<size_t> heapAllocations{0};
+
+void* operator new(size_t size) {
+    heapAllocations.fetch_add(1, memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1)) return p;
+    throw bad_alloc();
+}
+// The pmr resources, such as the arena's upstream, allocate through this one.
+void* operator new(size_t size, align_val_t alignment) {
+    heapAllocations.fetch_add(1, memory_order_relaxed);
+    size_t align = size_t(alignment);
+    if (void* p = aligned_alloc(align, (max<size_t>(size, 1) + align - 1) / align * align)) return p;
+    throw bad_alloc();
+}
+// And some of the standard algorithms, such as stable_sort for its buffer, through these.
+void* operator new(size_t size, const nothrow_t&) noexcept {
+    heapAllocations.fetch_add(1, memory_order_relaxed);
+    return malloc(size ? size : 1);
+}
+void* operator new(size_t size, align_val_t alignment, const nothrow_t&) noexcept {
+    heapAllocations.fetch_add(1, memory_order_relaxed);
+    size_t align = size_t(alignment);
+    return aligned_alloc(align, (max<size_t>(size, 1) + align - 1) / align * align);
+}
+// GCC does not know that the operator news above are malloc, and would warn about every free() below.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept {
+    free(p);
+}
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+void operator delete(void* p, align_val_t) noexcept {
+    free(p);
+}
+void operator delete(void* p, size_t, align_val_t) noexcept {
+    free(p);
+}
+void operator delete(void* p, const nothrow_t&) noexcept {
+    free(p);
+}
+void operator delete(void* p, align_val_t, const nothrow_t&) noexcept {
+    free(p);
+}
+#pragma GCC diagnostic pop
+#endif
+
+
+/// Memory for the containers of one step's search (Paths, Routes, BFS queues...), all freed at once by reset().
+/// Freed blocks are reused within the step by the pool, and the pool gets its chunks from one buffer that is
+/// allocated once, so a step should not touch the heap unless it outgrows the buffer.
+/// Containers of the search take resource() explicitly; it is the arena of the innermost Scope alive on the calling
+/// thread, or the heap outside of any. The arena is not thread safe, so each thread that plans needs its own, and
+/// what one thread allocates must not be freed by another.
+class SearchArena {
+public:
+    explicit SearchArena(size_t bytes)
+     : buffer(new std::byte[bytes]), arena(buffer.get(), bytes, pmr::new_delete_resource()), pool(&arena)
+     {}
+
+    void reset() {
+        pool.release();
+        arena.release();
+    }
+
+    static pmr::memory_resource* resource() {
+        return current ? &current->pool : pmr::new_delete_resource();
+    }
+
+    class Scope {
+    public:
+        explicit Scope(SearchArena& a) : previousArena(current) {
+            current = &a;
+        }
+        ~Scope() {
+            current = previousArena;
+        }
+    private:
+        SearchArena* previousArena;
+    };
+
+private:
+    static inline thread_local SearchArena* current = nullptr;
+
+    unique_ptr<std::byte[]> buffer;
+    pmr::monotonic_buffer_resource arena;
+    pmr::unsynchronized_pool_resource pool;
+};
+
+
+#ifdef PACMAN_THREADS
+/// Worker threads that run parallel loops, possibly nested: tasks may run parallelFor themselves. Each thread keeps
+/// its tasks in its own deque and takes them from the back, and an idle thread steals from the front of the others'.
+/// A thread waiting for its loop to finish runs the tasks of that loop no one took yet, so nesting cannot deadlock.
+/// Only built with -DPACMAN_THREADS=<number of threads>, for local runs and self-play; the game gives a bot one core.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(int numThreads) : queues(numThreads + 1) {    // The last queue is for threads outside the pool.
+        for (int i = 0; i < numThreads; i++) {
+            workers.emplace_back([this, i] {
+                self = i;
+                work();
+            });
+        }
+    }
+
+    ~WorkStealingPool() {
+        stopping = true;
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    /// Runs task(i) for every 0 <= i < n, and returns once they are all done. While waiting, the calling thread only
+    /// runs tasks of this loop; once none are left to take, it sleeps until the ones other threads took are done.
+    void parallelFor(int n, const function<void(int)>& task) {
+        Loop loop;
+        loop.pending = n;
+        Queue& own = queues[ownQueue()];
+        {
+            lock_guard<mutex> lock(own.mtx);
+            for (int i = n - 1; i >= 0; i--) own.tasks.push_back({&task, i, &loop});   // So that task(0) is taken first.
+        }
+        wake.notify_all();
+        Task next;
+        while (takeOwn(&loop, next)) run(next);
+        unique_lock<mutex> lock(loop.mtx);
+        loop.done.wait(lock, [&] { return loop.pending == 0; });
+    }
+
+    int size() const {
+        return workers.size();
+    }
+
+private:
+    struct Loop {
+        int pending;    // Tasks not done yet. Guarded by mtx.
+        mutex mtx;
+        condition_variable done;
+    };
+    struct Task {
+        const function<void(int)>* fn;
+        int index;
+        Loop* loop;
+    };
+    struct Queue {
+        mutex mtx;
+        deque<Task> tasks;
+    };
+
+    int ownQueue() const {
+        return self >= 0 ? self : int(workers.size());
+    }
+
+    void run(const Task& task) {
+        (*task.fn)(task.index);
+        lock_guard<mutex> lock(task.loop->mtx);     // Held while notifying, so that the loop outlives this.
+        if (--task.loop->pending == 0) task.loop->done.notify_all();
+    }
+
+    /// The newest task of this thread's queue, if it belongs to loop. Loops started later by this thread are done
+    /// by the time it looks, so the tasks of loop are the newest ones.
+    bool takeOwn(Loop* loop, Task& task) {
+        Queue& queue = queues[ownQueue()];
+        lock_guard<mutex> lock(queue.mtx);
+        if (queue.tasks.empty() || queue.tasks.back().loop != loop) return false;
+        task = queue.tasks.back();
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    /// The newest task of this thread, else the oldest one of another.
+    bool take(Task& task) {
+        int own = ownQueue();
+        for (int k = 0; k < int(queues.size()); k++) {
+            Queue& queue = queues[(own + k) % queues.size()];
+            lock_guard<mutex> lock(queue.mtx);
+            if (queue.tasks.empty()) continue;
+            if (k == 0) {
+                task = queue.tasks.back();
+                queue.tasks.pop_back();
+            }
+            else {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void work() {
+        while (!stopping) {
+            Task task;
+            if (take(task)) {
+                run(task);
+            }
+            else {
+                unique_lock<mutex> lock(sleepMutex);
+                wake.wait_for(lock, chrono::milliseconds(1));
+            }
+        }
+    }
+
+    static inline thread_local int self = -1;   // Index of this thread in workers, -1 outside the pool.
+    vector<Queue> queues;
+    vector<thread> workers;
+    mutex sleepMutex;
+    condition_variable wake;
+    atomic<bool> stopping{false};
+};
+#endif
+
+
 
 class Pacman;
 
 class Tile {
 public:
     int x=-1, y=-1;
+    int id = -1;    // Index into the per-tile tables of the Board. Assigned in buildBoard.
     int pelletValue = -1;  // -1 means we don't know if pellet exists there. 0 means pellet does not exist for sure. If >0 means pellet exists of that value.
+    int prevPelletValue = -1;   // pelletValue of the previous step.
     double pelletValueAdjusted = 1.0;   // Must be updated each step;
     vector<Tile*> neighbours;
 
@@ -100,18 +363,422 @@ ostream& operator<<(ostream& out, const Tile& tile) {
 
 using Coord = pair<int, int>;   // (x, y) which is equivalent to (col, row). x & y must be positive.
 using PacDestinationT = map<Tile*, Pacman*>;
-using Path = vector<Tile*>;
-using PathsValsT = vector<pair<double, Path>>;
+using Path = pmr::vector<Tile*>;
+using PathsValsT = pmr::vector<pair<double, Path>>;
 using PacRoutesT = map<Pacman*, Path>;
 
+
+/// Up to Capacity elements stored inside the object itself. For the short lists that every route node carries.
+template<class T, int Capacity>
+class InlineVector {
+public:
+    void push_back(const T& value) {
+        if (count == Capacity) throw length_error("InlineVector is full");
+        items[count++] = value;
+    }
+    int size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T& operator[](int i) const { return items[i]; }
+    const T* begin() const { return items; }
+    const T* end() const { return items + count; }
+
+private:
+    T items[Capacity];
+    int count = 0;
+};
+
+
+/// A path of at most `capacity` tiles, stored inline as 16-bit tile ids so that copying one is a small memcpy.
+/// A bitset over all tile ids answers "is this tile on the path?" without a scan.
+/// Reads give back Tile pointers through `tiles`, which is set once the board is built.
+class TilePath {
+public:
+    static constexpr int capacity = 30;
+    static constexpr int maxTiles = 640;    // Boards are at most 35 by 17, so tile ids are below this.
+    static inline Tile* const* tiles = nullptr;   // [tile id] -> tile.
+
+    class iterator {
+    public:
+        using iterator_category = forward_iterator_tag;
+        using value_type = Tile*;
+        using difference_type = ptrdiff_t;
+        using pointer = Tile* const*;
+        using reference = Tile*;
+
+        iterator() = default;
+        explicit iterator(const uint16_t* p) : p(p) {}
+        Tile* operator*() const { return tiles[*p]; }
+        iterator& operator++() { ++p; return *this; }
+        iterator operator++(int) { iterator old = *this; ++p; return old; }
+        bool operator==(const iterator& other) const { return p == other.p; }
+        bool operator!=(const iterator& other) const { return p != other.p; }
+    private:
+        const uint16_t* p = nullptr;
+    };
+
+    TilePath() = default;
+
+    /// The first `capacity` tiles of [first, last): anything after them is dropped, not an error.
+    template<class It>
+    TilePath(It first, It last) {
+        for (; first != last && count < capacity; ++first) push_back(*first);
+    }
+
+    void push_back(const Tile* tile) {
+        if (count == capacity) throw length_error("TilePath is full");
+        ids[count++] = tile->id;
+        onPath[tile->id >> 6] |= 1ULL << (tile->id & 63);
+    }
+
+    void eraseFront() {
+        if (std::find(ids + 1, ids + count, ids[0]) == ids + count) {   // Routes can walk back over a tile.
+            onPath[ids[0] >> 6] &= ~(1ULL << (ids[0] & 63));
+        }
+        memmove(ids, ids + 1, (count - 1) * sizeof(ids[0]));
+        count--;
+    }
+
+    bool contains(const Tile* tile) const {
+        return onPath[tile->id >> 6] >> (tile->id & 63) & 1;
+    }
+
+    int size() const { return count; }
+    bool empty() const { return count == 0; }
+    Tile* operator[](int i) const { return tiles[ids[i]]; }
+    Tile* front() const { return tiles[ids[0]]; }
+    Tile* back() const { return tiles[ids[count - 1]]; }
+    iterator begin() const { return iterator(ids); }
+    iterator end() const { return iterator(ids + count); }
+
+private:
+    uint64_t onPath[maxTiles / 64] = {};   // Bit per tile id.
+    uint16_t ids[capacity];
+    uint16_t count = 0;
+};
+
+
+/// Discounting of route rewards by gamma = GammaPermille / 1000 per step, with every power of gamma up to
+/// Horizon worked out at compile time so that scoring a step is a table read.
+template<int GammaPermille, int Horizon>
+struct RewardPolicy {
+    static constexpr double gamma = GammaPermille / 1000.0;
+    static constexpr int horizon = Horizon;
+
+    /// gamma^k, for 0 <= k <= Horizon.
+    static constexpr double discount(int k) {
+        return powers[k];
+    }
+
+    /// gamma^from + ... + gamma^to, for 0 <= from and to <= Horizon. 0 when from > to.
+    static constexpr double discountSum(int from, int to) {
+        return from > to ? 0 : prefixSums[to + 1] - prefixSums[from];
+    }
+
+private:
+    static constexpr array<double, Horizon + 1> powers = [] {
+        array<double, Horizon + 1> p{};
+        p[0] = 1;
+        for (int k = 1; k <= Horizon; k++) p[k] = p[k - 1] * gamma;
+        return p;
+    }();
+    static constexpr array<double, Horizon + 2> prefixSums = [] {   // prefixSums[k] = gamma^0 + ... + gamma^(k-1)
+        array<double, Horizon + 2> s{};
+        for (int k = 0; k <= Horizon; k++) s[k + 1] = s[k] + powers[k];
+        return s;
+    }();
+};
+
 class Board {
 public:
     std::map<Coord, Tile> tiles; // Like an adjacency list
     int width, height;
     set<Tile*> superPelletTiles;    // NOTE: These are tiles where Super Pellets WERE present in the beginning of game. The super pellets may not be on the tiles anymore.
     int numUnknownPellets;  // Must be updated each step.
+    uint64_t pelletHash = 0;    // Zobrist hash of the pelletValue of all tiles. Kept up to date by setPelletValue.
+    vector<Tile*> tileById;
+    vector<float> pelletSurvival;   // Probability that the pellet on each tile is still there. Must be updated each step.
+    float minPelletExpectation = 0.1;
+
+    // Maps are mirrored left-right. When they are, the static tables below only store rows for the left half
+    // (including the middle column), and rows of the right half are looked up through the mirror tile.
+    bool mirrored = false;
+    vector<int> mirrorId;   // [tile id] -> id of the tile mirrored across the vertical axis. Identity if not mirrored.
+    vector<int> tableRow;   // [tile id] -> row in the static tables, or -1 if the tile is on the stored half's mirror side.
+    int numTableRows = 0;
+    vector<uint16_t> distances; // Walking distances. distances[tableRow[a] * numTiles() + b]
+    vector<vector<int>> visibility; // [tableRow] -> ids of the tiles in line of sight (including the tile itself).
+
+    // Peeling the tiles with one way out off the board, again and again, leaves the core: tiles on loops. What was
+    // peeled off hangs off the core in pockets, each entered from a single core tile, its exit.
+    struct Pocket {
+        int exit;
+        vector<int> tiles;  // By depth, entrance first. In a linear pocket, tiles[d-1] is d steps from the exit.
+        bool linear;        // No forks: one corridor that ends in a dead end.
+        double value = 0;   // Sum of the adjusted pellet values in it. Updated with them.
+    };
+    vector<Pocket> pockets;
+    vector<int> pocketOf;       // [tile id] -> index in pockets, or -1 for tiles of the core.
+
+    // Expected pellets within k steps of each tile, for k up to massRadius. Kept up to date with the adjusted pellet
+    // values by adding what changed to the tiles within reach of it.
+    static constexpr int massRadius = 4;
+    struct BallTile {
+        int id;
+        int distance;
+    };
+    vector<vector<BallTile>> balls; // [tile id] -> tiles within massRadius steps, and how many steps.
+    vector<double> pelletMass;      // [tile id * (massRadius + 1) + k]
     Board() {}
 
+    int numTiles() const {
+        return tileById.size();
+    }
+
+    /// All writes of pelletValue go through here, so that pelletHash changes only with the tiles that change.
+    /// Unknown (-1) pellets hash to 0, which makes the hash of a new board 0.
+    void setPelletValue(Tile* tile, int value) {
+        if (tile->pelletValue == value) return;
+        pelletHash ^= pelletKey(tile->id, tile->pelletValue) ^ pelletKey(tile->id, value);
+        tile->pelletValue = value;
+    }
+
+    static uint64_t pelletKey(int tileId, int pelletValue) {
+        if (pelletValue == -1) return 0;
+        return zobrist(tileId * 3 + (pelletValue == 0 ? 0 : pelletValue == 1 ? 1 : 2), 5);
+    }
+
+    Tile* mirrorOf(const Tile* tile) const {
+        return tileById[mirrorId[tile->id]];
+    }
+
+    int distance(const Tile* a, const Tile* b) const {
+        int row = tableRow[a->id];
+        if (row >= 0) {
+            return distances[row * numTiles() + b->id];
+        }
+        return distances[tableRow[mirrorId[a->id]] * numTiles() + mirrorId[b->id]];
+    }
+
+    /// Calls fn(tile id) for every tile in line of sight of the given tile.
+    template<class Fn>
+    void forEachVisible(const Tile* from, Fn fn) const {
+        if (visibility.empty()) {   // Table skipped by the precompute budget.
+            forEachInLineOfSight(from, fn);
+            return;
+        }
+        int row = tableRow[from->id];
+        if (row >= 0) {
+            for (int id : visibility[row]) fn(id);
+        }
+        else {
+            for (int id : visibility[tableRow[mirrorId[from->id]]]) fn(mirrorId[id]);
+        }
+    }
+
+    /// Must run after tile ids are assigned.
+    void detectSymmetry(const vector<string>& grid) {
+        mirrored = true;
+        for (auto& row : grid) {
+            mirrored = mirrored && equal(row.begin(), row.end(), row.rbegin());
+        }
+
+        int n = numTiles();
+        mirrorId.resize(n);
+        tableRow.assign(n, -1);
+        numTableRows = 0;
+        for (Tile* tile : tileById) {
+            mirrorId[tile->id] = mirrored ? tiles.at({width - 1 - tile->x, tile->y}).id : tile->id;
+            if (!mirrored || tile->x <= (width - 1) / 2) {
+                tableRow[tile->id] = numTableRows++;
+            }
+        }
+    }
+
+    /// A pac sees along its row and column until a wall, wrapping around the edges. Calls fn(tile id) for each of
+    /// those tiles, the given one first.
+    template<class Fn>
+    void forEachInLineOfSight(const Tile* from, Fn fn) const {
+        static constexpr int dx[] = {1, -1, 0, 0};
+        static constexpr int dy[] = {0, 0, 1, -1};
+        fn(from->id);
+        for (int i = 0; i < 4; i++) {
+            int x = mod(from->x + dx[i], width);
+            int y = mod(from->y + dy[i], height);
+            auto it = tiles.find({x, y});
+            while (it != tiles.end() && &it->second != from) {
+                fn(it->second.id);
+                x = mod(x + dx[i], width);
+                y = mod(y + dy[i], height);
+                it = tiles.find({x, y});
+            }
+        }
+    }
+
+    /// Gives up and leaves the table empty once past the deadline.
+    bool buildVisibilityTable(chrono::steady_clock::time_point deadline) {
+        visibility.assign(numTableRows, {});
+        for (Tile* from : tileById) {
+            if (tableRow[from->id] < 0) continue;
+            if (chrono::steady_clock::now() > deadline) {
+                vector<vector<int>>().swap(visibility);
+                return false;
+            }
+            forEachInLineOfSight(from, [&](int id) { visibility[tableRow[from->id]].push_back(id); });
+        }
+        return true;
+    }
+
+    size_t visibilityTableBytes() const {
+        size_t bytes = visibility.capacity() * sizeof(vector<int>);
+        for (auto& row : visibility) bytes += row.capacity() * sizeof(int);
+        return bytes;
+    }
+
+    /// BFS from every tile of the stored half. Maps are small (a few hundred tiles) so this is cheap even in the first turn.
+    void buildDistanceTable() {
+        int n = numTiles();
+        distances.assign(numTableRows * n, UINT16_MAX);
+        vector<int> q(n);
+        for (int src = 0; src < n; src++) {
+            if (tableRow[src] < 0) continue;
+            uint16_t* row = &distances[tableRow[src] * n];
+            int head = 0, tail = 0;
+            q[tail++] = src;
+            row[src] = 0;
+            while (head < tail) {
+                Tile* curr = tileById[q[head++]];
+                for (Tile* neighbour : curr->neighbours) {
+                    if (row[neighbour->id] == UINT16_MAX) {
+                        row[neighbour->id] = row[curr->id] + 1;
+                        q[tail++] = neighbour->id;
+                    }
+                }
+            }
+        }
+    }
+
+    void buildDeadEndTables() {
+        int n = numTiles();
+        vector<int> degree(n);
+        vector<int> peeled;
+        vector<bool> inCore(n, true);
+        for (Tile* tile : tileById) {
+            degree[tile->id] = tile->neighbours.size();
+            if (degree[tile->id] <= 1) {
+                inCore[tile->id] = false;
+                peeled.push_back(tile->id);
+            }
+        }
+        for (int i = 0; i < int(peeled.size()); i++) {
+            for (Tile* neighbour : tileById[peeled[i]]->neighbours) {
+                if (inCore[neighbour->id] && --degree[neighbour->id] <= 1) {
+                    inCore[neighbour->id] = false;
+                    peeled.push_back(neighbour->id);
+                }
+            }
+        }
+
+        // Pockets are found from their exits, so when there is no core (the map is a tree) there are none.
+        pockets.clear();
+        pocketOf.assign(n, -1);
+        for (Tile* exit : tileById) {
+            if (!inCore[exit->id]) continue;
+            for (Tile* entrance : exit->neighbours) {
+                if (inCore[entrance->id]) continue;
+                Pocket pocket{exit->id, {entrance->id}, true};
+                pocketOf[entrance->id] = pockets.size();
+                for (int i = 0; i < int(pocket.tiles.size()); i++) {
+                    Tile* curr = tileById[pocket.tiles[i]];
+                    pocket.linear = pocket.linear && curr->neighbours.size() <= 2;
+                    for (Tile* neighbour : curr->neighbours) {
+                        if (inCore[neighbour->id] || pocketOf[neighbour->id] >= 0) continue;
+                        pocketOf[neighbour->id] = pockets.size();
+                        pocket.tiles.push_back(neighbour->id);
+                    }
+                }
+                for (int id : pocket.tiles) pocket.value += tileById[id]->pelletValueAdjusted;
+                pockets.push_back(move(pocket));
+            }
+        }
+    }
+
+    size_t deadEndTableBytes() const {
+        size_t bytes = pocketOf.capacity() * sizeof(int);
+        bytes += pockets.capacity() * sizeof(Pocket);
+        for (auto& pocket : pockets) bytes += pocket.tiles.capacity() * sizeof(int);
+        return bytes;
+    }
+
+    /// The pocket that stepping from one tile to the next walks into, if any.
+    const Pocket* pocketEnteredBy(const Tile* from, const Tile* to) const {
+        if (pocketOf.empty()) return nullptr;   // Table skipped by the precompute budget.
+        int p = pocketOf[to->id];
+        if (p < 0 || pockets[p].exit != from->id) return nullptr;
+        return &pockets[p];
+    }
+
+    /// Tiles in a corridor have at most one way on for a route passing through.
+    bool inCorridor(const Tile* tile) const {
+        return tile->neighbours.size() <= 2;
+    }
+
+    /// BFS up to massRadius from every tile. The field starts from the adjusted pellet values as they are now.
+    /// Gives up and leaves the field empty once past the deadline.
+    bool buildPelletMassField(chrono::steady_clock::time_point deadline) {
+        int n = numTiles();
+        balls.assign(n, {});
+        vector<int> dist(n, -1);
+        vector<int> q;
+        for (Tile* source : tileById) {
+            if (chrono::steady_clock::now() > deadline) {
+                vector<vector<BallTile>>().swap(balls);
+                return false;
+            }
+            vector<BallTile>& ball = balls[source->id];
+            q.assign(1, source->id);
+            dist[source->id] = 0;
+            for (int head = 0; head < int(q.size()); head++) {
+                int curr = q[head];
+                ball.push_back({curr, dist[curr]});
+                if (dist[curr] == massRadius) continue;
+                for (Tile* neighbour : tileById[curr]->neighbours) {
+                    if (dist[neighbour->id] == -1) {
+                        dist[neighbour->id] = dist[curr] + 1;
+                        q.push_back(neighbour->id);
+                    }
+                }
+            }
+            for (int id : q) dist[id] = -1;
+        }
+
+        pelletMass.assign(n * (massRadius + 1), 0.0);
+        for (Tile* tile : tileById) {
+            addPelletMass(tile, tile->pelletValueAdjusted);
+        }
+        return true;
+    }
+
+    size_t pelletMassFieldBytes() const {
+        size_t bytes = balls.capacity() * sizeof(vector<BallTile>) + pelletMass.capacity() * sizeof(double);
+        for (auto& ball : balls) bytes += ball.capacity() * sizeof(BallTile);
+        return bytes;
+    }
+
+    /// Distances are symmetric, so the tiles within reach of a tile are the ones whose field counts it.
+    void addPelletMass(const Tile* tile, double delta) {
+        if (delta == 0 || pelletMass.empty()) return;
+        for (const BallTile& other : balls[tile->id]) {
+            double* mass = &pelletMass[other.id * (massRadius + 1)];
+            for (int k = other.distance; k <= massRadius; k++) mass[k] += delta;
+        }
+    }
+
+    /// Sum of the adjusted pellet values of the tiles at most k (up to massRadius) steps from the given tile.
+    /// Only once the field is built: callers check pelletMass, which stays empty if the precompute budget skipped it.
+    double pelletMassWithin(const Tile* tile, int k) const {
+        return pelletMass[tile->id * (massRadius + 1) + min(k, massRadius)];
+    }
+
     bool isInBounds(int x, int y) {
         if (x >= 0 && x < width && y >=0 && y < height) return true;
         return false;
@@ -133,35 +800,49 @@ public:
             return element.second.pelletValue == -1;
         });
     }
-    void updatePelletAdjustValues(int numOpponentAliveInvisiblePacs) {
-        // If we have N tiles of unknown pellets and m opponent pacmans, then after n game steps,
-        // the expectated value of an unknown pellet being there is roughly of the form:
-        //      E = (N - m*n) / N
-        //
-        // Ideally, n should be number of steps taken by opponent pacmans when they were out of sight.
-        // Also, this is an optimistic estimate but the optimism should be compensated by the fact that there
-        // are fake game steps that we can't count.
-        //
-        // Since m can change due to pacmans dying, use incremental update:
-        //      E' = E - m/N
-        //  Now, if we make m = number of alive opponent pacs that are not visible in this turn (ideally last turn), then
-        //  this formula is much more accurate.
-        //
-        // Also, whenever we see this tile again, we reset it.
-
-        for (auto& [_, tile] : tiles) {
-            if (tile.pelletValue == -1) {
-                tile.pelletValueAdjusted = tile.pelletValueAdjusted - 1.0*numOpponentAliveInvisiblePacs / numUnknownPellets;
-
-                if (tile.pelletValueAdjusted <= 0.0) {
-                    tile.pelletValueAdjusted = 0.1;     // Keep a minimum expected value.
-                }
+    /// occupancy[tile id] is the expected number of invisible enemy pacs on that tile in this step (see BeliefTracker).
+    void updatePelletAdjustValues(const vector<float>& occupancy) {
+        // An unknown pellet survives this step unless an enemy pac is on its tile, so its expected value is
+        // the product over all steps since we last saw it of (1 - occupancy).
+        // Whenever we see this tile again, we reset it.
+        int n = numTiles();
+        if (int(pelletSurvival.size()) != n) {
+            pelletSurvival.assign(n, 1.0f);
+        }
+        vector<float> known(n);
+        vector<float> isUnknown(n);
+        for (int i = 0; i < n; i++) {
+            int value = tileById[i]->pelletValue;
+            isUnknown[i] = value == -1;
+            known[i] = value > 0 ? 1.0f : 0.0f;
+        }
+
+        float* survival = pelletSurvival.data();
+        const float* occ = occupancy.data();
+        for (int i = 0; i < n; i++) {
+            float decayed = survival[i] * max(0.0f, 1.0f - occ[i]);
+            survival[i] = isUnknown[i] * decayed + (1.0f - isUnknown[i]) * known[i];
+        }
+
+        for (int i = 0; i < n; i++) {
+            Tile* tile = tileById[i];
+            if (tile->pelletValue == -1) {
+                setPelletValueAdjusted(tile, max(minPelletExpectation, survival[i]));    // Keep a minimum expected value.
             }
             else {
                 // This resets the values of previously unknown tiles.
-                tile.pelletValueAdjusted = tile.pelletValue;
+                setPelletValueAdjusted(tile, tile->pelletValue);
             }
+        }
+    }
 
+    /// All writes of pelletValueAdjusted go through here, so that the pellet-mass field and the pocket values follow.
+    void setPelletValueAdjusted(Tile* tile, double value) {
+        double delta = value - tile->pelletValueAdjusted;
+        tile->pelletValueAdjusted = value;
+        addPelletMass(tile, delta);
+        if (!pocketOf.empty() && pocketOf[tile->id] >= 0) {
+            pockets[pocketOf[tile->id]].value += delta;
         }
     }
 
@@ -187,146 +868,1096 @@ ostream& operator<<(ostream& out, const Board& board) {
 }
 
 
-class Route {
-public:
-    Path fullPath;
-    Path pathUptoFirstPellet;
-    Path additionalPath;
-    Tile* firstPelletTile = nullptr;
-    double totalReward = 0;
-    double additionalPathValue = -9999;
-    int horizon = -1;
-    vector<Tile*> superPellets;
-    vector<Pacman*> enemyPacsOnRoute;
-    double rewardModifier = 1.0;    // This should ideally not be part of this class, but laziness.
+class Route {
+public:
+    TilePath fullPath;
+    Tile* firstPelletTile = nullptr;
+    double totalReward = 0;
+    double additionalPathValue = -9999;
+    int horizon = -1;
+    InlineVector<Tile*, 8> superPellets;
+    InlineVector<Pacman*, 8> enemyPacsOnRoute;
+    double rewardModifier = 1.0;    // This should ideally not be part of this class, but laziness.
+
+    Tile* firstStep() const {
+        return fullPath.size() < 1 ? nullptr : fullPath[0];
+    }
+    Tile* secondStep() const {
+        return fullPath.size() < 2 ? nullptr : fullPath[1];
+    }
+    bool empty() const {
+        return fullPath.empty();
+    }
+    bool hasSuperPellets() const {
+        return !superPellets.empty();
+    }
+    friend ostream& operator<<(ostream& out, const Route& route);
+};
+ostream& operator<<(ostream& out, const Route& route) {
+    out << "Rt:" << setprecision(3) << route.totalReward << " ";
+    for (auto t : route.fullPath) {
+        if (t == route.firstPelletTile) out << "[";
+        if (t->getPelletValueAdjusted() == 10) out << "<";
+        out << t->toStr();
+        if (t->getPelletValueAdjusted() == 10) out << ">";
+        if (t == route.firstPelletTile) out << "]";
+        out << " ";
+    }
+    return out;
+}
+
+
+/// Tile ids of many routes laid out step-major, 8 routes side by side (ids[(block * length + step) * lanes + lane]),
+/// so that scoring a step of 8 routes is one AVX2 gather. Routes shorter than the longest are padded with padId,
+/// which must have a value of 0 in the values given to score(). Each step of each route has a weight, laid out the
+/// same way.
+class RouteBatch {
+public:
+    static constexpr int lanes = 8;
+
+    /// stepWeights[r][k] is the weight of the k-th step of routes[r].
+    RouteBatch(const pmr::vector<Route>& routes, int padId, const pmr::vector<array<float, TilePath::capacity>>& stepWeights) {
+        numRoutes = routes.size();
+        numBlocks = (numRoutes + lanes - 1) / lanes;
+        length = 0;
+        for (auto& route : routes) length = max(length, route.fullPath.size());
+        ids.assign(numBlocks * length * lanes, padId);
+        weights.assign(numBlocks * length * lanes, 0.0f);
+        for (int r = 0; r < numRoutes; r++) {
+            const TilePath& path = routes[r].fullPath;
+            int offset = (r / lanes) * length * lanes + r % lanes;
+            for (int k = 0; k < path.size(); k++) {
+                ids[offset + k * lanes] = path[k]->id;
+                weights[offset + k * lanes] = stepWeights[r][k];
+            }
+        }
+    }
+
+    /// Number of results score() writes: the number of routes rounded up to a multiple of lanes.
+    int paddedSize() const {
+        return numBlocks * lanes;
+    }
+
+    /// out[r] = sum over the steps k of route r of values[its k-th tile id] * its k-th step weight.
+    void score(const float* values, float* out) const {
+        for (int b = 0; b < numBlocks; b++) {
+            const int32_t* block = &ids[b * length * lanes];
+            const float* blockWeights = &weights[b * length * lanes];
+#ifdef __AVX2__
+            __m256 total = _mm256_setzero_ps();
+            for (int k = 0; k < length; k++) {
+                __m256i stepIds = _mm256_loadu_si256((const __m256i*)(block + k * lanes));
+                __m256 stepValues = _mm256_i32gather_ps(values, stepIds, sizeof(float));
+                total = _mm256_add_ps(total, _mm256_mul_ps(stepValues, _mm256_loadu_ps(blockWeights + k * lanes)));
+            }
+            _mm256_storeu_ps(out + b * lanes, total);
+#else
+            float total[lanes] = {};
+            for (int k = 0; k < length; k++) {
+                for (int lane = 0; lane < lanes; lane++) {
+                    total[lane] += values[block[k * lanes + lane]] * blockWeights[k * lanes + lane];
+                }
+            }
+            copy(total, total + lanes, out + b * lanes);
+#endif
+        }
+    }
+
+private:
+    int numRoutes, numBlocks, length;
+    pmr::vector<int32_t> ids{SearchArena::resource()};
+    pmr::vector<float> weights{SearchArena::resource()};
+};
+
+
+/// Keeps the k best routes offered to it by totalReward, as a min-heap, and drops the rest as they come.
+/// Also tracks how many were offered and their reward range, for the logs.
+class TopRoutes {
+public:
+    explicit TopRoutes(int k) : k(k) {}
+
+    void offer(Route&& route) {
+        offered++;
+        minReward = min(minReward, route.totalReward);
+        maxReward = max(maxReward, route.totalReward);
+        if (int(heap.size()) < k) {
+            heap.push_back(move(route));
+            push_heap(heap.begin(), heap.end(), worseFirst);
+        }
+        else if (route.totalReward > heap.front().totalReward) {
+            pop_heap(heap.begin(), heap.end(), worseFirst);
+            heap.back() = move(route);
+            push_heap(heap.begin(), heap.end(), worseFirst);
+        }
+    }
+
+    /// The kept routes, best first. Leaves this empty.
+    pmr::vector<Route> takeSorted() {
+        sort_heap(heap.begin(), heap.end(), worseFirst);
+        return move(heap);
+    }
+
+    bool empty() const { return heap.empty(); }
+    int numOffered() const { return offered; }
+    double worstOffered() const { return offered ? minReward : 0.0; }
+    double bestOffered() const { return offered ? maxReward : 0.0; }
+
+private:
+    static bool worseFirst(const Route& a, const Route& b) {    // Heap order; sort_heap with it gives best first.
+        return a.totalReward > b.totalReward;
+    }
+
+    int k;
+    pmr::vector<Route> heap{SearchArena::resource()};
+    int offered = 0;
+    double minReward = 1e18, maxReward = -1e18;
+};
+
+#ifdef PACMAN_THREADS
+/// The k best rewards offered by any thread, for searches running in parallel that keep k routes between them: a
+/// route that cannot beat the k-th best would not be kept anyway. Reading the k-th best takes no lock.
+class SharedTopRewards {
+public:
+    SharedTopRewards(int k, double floor) : k(k), kth(floor) {}
+
+    void offer(double reward) {
+        if (reward <= kth.load(memory_order_relaxed)) return;
+        lock_guard<mutex> lock(mtx);
+        rewards.push(reward);
+        if (int(rewards.size()) > k) rewards.pop();
+        if (int(rewards.size()) == k) kth.store(max(kth.load(memory_order_relaxed), rewards.top()), memory_order_relaxed);
+    }
+
+    /// The k-th best reward offered so far, or floor while fewer than k were.
+    double kthBest() const {
+        return kth.load(memory_order_relaxed);
+    }
+
+private:
+    int k;
+    atomic<double> kth;
+    mutex mtx;
+    priority_queue<double, vector<double>, greater<double>> rewards;
+};
+#endif
+
+
+/// Best reward below states of the route search, so that a state the search reaches again through another prefix or
+/// frontier path is not searched again. A fixed number of buckets of two entries: the first keeps whichever of its
+/// states has more steps left below it, the second takes whatever came last. Entries are written without locks as
+/// (key ^ data, data), so searches running in parallel can share the table and a torn write reads back as a miss.
+class TranspositionTable {
+public:
+    static constexpr int noTile = 1023;     // Tile ids must be below this.
+
+    struct Entry {
+        double value;   // Best discounted reward over the steps below the state. Kept as a float, rounded up.
+        bool exact;     // Else value is only an upper bound, because some of those steps were pruned.
+        int bestNext;   // Id of the tile to step on for value; noTile when there is no step to take.
+    };
+
+    /// numBuckets must be a power of 2.
+    explicit TranspositionTable(int numBuckets) : buckets(numBuckets), mask(numBuckets - 1) {}
+
+    /// Entries stored under another generation read as misses, so taking a new one empties the table.
+    uint16_t newGeneration() {
+        return ++generation;
+    }
+
+    optional<Entry> probe(uint64_t key, uint16_t gen) const {
+        for (const Slot& slot : buckets[key & mask]) {
+            uint64_t data = slot.data.load(memory_order_relaxed);
+            if ((slot.check.load(memory_order_relaxed) ^ data) == key && generationOf(data) == gen) {
+                float value;
+                uint32_t bits = data;
+                memcpy(&value, &bits, sizeof(value));
+                return Entry{value, bool(data >> 63), int(data >> 53 & 1023)};
+            }
+        }
+        return nullopt;
+    }
+
+    void store(uint64_t key, uint16_t gen, int stepsLeft, const Entry& entry) {
+        float value = entry.value;
+        if (value < entry.value) value = nextafterf(value, INFINITY);   // Still a bound to prune by.
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        uint64_t data = bits | uint64_t(gen) << 32 | uint64_t(min(stepsLeft, 31)) << 48 | uint64_t(entry.bestNext) << 53
+                        | uint64_t(entry.exact) << 63;
+        Bucket& bucket = buckets[key & mask];
+        uint64_t deep = bucket[0].data.load(memory_order_relaxed);
+        Slot& slot = generationOf(deep) != gen || stepsLeftOf(deep) <= stepsLeft ? bucket[0] : bucket[1];
+        slot.check.store(key ^ data, memory_order_relaxed);
+        slot.data.store(data, memory_order_relaxed);
+    }
+
+private:
+    struct Slot {
+        atomic<uint64_t> check{0};
+        atomic<uint64_t> data{0};
+    };
+    using Bucket = array<Slot, 2>;
+
+    static uint16_t generationOf(uint64_t data) { return data >> 32; }
+    static int stepsLeftOf(uint64_t data) { return data >> 48 & 31; }
+
+    vector<Bucket> buckets;
+    uint64_t mask;
+    atomic<uint16_t> generation{0};
+};
+
+
+class Pacman {
+public:
+    int pacId; // pac number (unique within a team)
+    bool mine; // true if this pac is yours
+    Tile* pos;
+    string typeId; // unused in wood leagues
+    int speedTurnsLeft; // unused in wood leagues
+    int abilityCooldown; // unused in wood leagues
+
+    const Board& board;
+    bool visible = true;    // Can be false for enemy pacs
+    int lastSeenStep = 0;   // gameSteps when this pac was last in the input.
+    vector<int> distanceToTile;     // [tile id] -> distance from pos, -1 if unreachable. Refilled each step.
+
+    Route route;    // Will change each step.
+    Route prevRoute;    // Last step's route from where the pac is now (see routeAheadOf), kept to warm-start the next search.
+
+    Pacman(int pacId, int mine, Tile* pos, string typeId, int speedTurnsLeft, int abilityCooldown, const Board& b)
+     : pacId(pacId), mine(mine), pos(pos), typeId(typeId), speedTurnsLeft(speedTurnsLeft), abilityCooldown(abilityCooldown), board(b)
+     {}
+
+    unordered_set<Tile*> getVisibleTiles() {
+        unordered_set<Tile*> visibleTiles;
+        board.forEachVisible(pos, [&](int id) {
+            visibleTiles.insert(board.tileById[id]);
+        });
+        return visibleTiles;
+    }
+
+    bool operator<(const Pacman& other) {
+        return pacId < other.pacId;
+    }
+
+    bool isSpeedActive() {
+        return speedTurnsLeft > 0;
+    }
+
+    Tile* getClaimedTile() {    // Return the pellet tile claimed by this pac on its boundary of pellets
+        return route.firstPelletTile;
+    }
+
+    Tile* getMoveDestination() {
+        if (isSpeedActive()) {
+            auto ret = route.secondStep();
+            if (!ret) ret = route.firstStep();
+            return ret;
+        }
+        else {
+            return route.firstStep();
+        }
+    }
+
+    Tile* getClosestSuperPellet() {
+        int minDist = 9999;
+        Tile* closest = nullptr;
+        for (auto t : board.superPelletTiles) {
+            if (t->pelletValue == 10) {
+                if (distanceToTile[t->id] != -1 && distanceToTile[t->id] < minDist) {
+                    minDist = distanceToTile[t->id];
+                    closest = t;
+                }
+            }
+        }
+        return closest;
+    }
+
+    string routeToStr() {
+        stringstream out;
+        out << "Rt:" << setprecision(3) << route.totalReward << "";
+        for (auto t : route.fullPath) {
+            if (t == getClaimedTile()) out << "[";
+            if (t == getMoveDestination()) out << "{";
+            if (t->getPelletValueAdjusted() == 10) out << "<";
+            if (t->pacOnTile) out << "|";
+            out << t->toStr();
+            if (t->pacOnTile) out << "|";
+            if (t->getPelletValueAdjusted() == 10) out << ">";
+            if (t == getMoveDestination()) out << "}";
+            if (t == getClaimedTile()) out << "]";
+            out << " ";
+        }
+        return out.str();
+    }
+
+    friend ostream& operator<<(ostream& out, const Pacman& pac);
+};
+ostream& operator<<(ostream& out, const Pacman& pac) {
+    out << "Pacman: " << "Id:"<< pac.pacId << " x:"<< pac.pos->x << " y:" << pac.pos->y << " mine:" << pac.mine;
+    return out;
+}
+
+
+/// Earliest turn at which an enemy pac that can eat a pac of a given type could be standing on each tile.
+/// Rebuilt every step, so that route search can check the safety of a tile at any depth with a single read.
+class DangerMap {
+public:
+    static constexpr int never = 9999;
+    static constexpr int speedDuration = 5;
+    vector<int> threatTurn[3];  // [typeIndex of my pac][tile id]
+
+    /// Number of turns to walk dist tiles, when the first speedTurnsLeft turns move 2 tiles each.
+    static constexpr int turnsToCover(int dist, int speedTurnsLeft) {
+        if (dist <= 2 * speedTurnsLeft) {
+            return (dist + 1) / 2;
+        }
+        return speedTurnsLeft + (dist - 2 * speedTurnsLeft);
+    }
+
+    /// Number of turns to walk dist tiles for an enemy without speed that activates SPEED as soon as its cooldown is
+    /// over. It keeps walking until then, and activating costs a turn in which it does not move.
+    static constexpr int turnsToCoverWithSpeedAfter(int dist, int cooldown) {
+        return cooldown + 1 + turnsToCover(max(0, dist - cooldown), speedDuration);
+    }
+
+    void reset(int numTiles) {
+        for (auto& turns : threatTurn) {
+            turns.assign(numTiles, never);
+        }
+    }
+
+    /// turnsSinceSeen > 0 means the enemy is not visible and enemy.pos is where we last saw it.
+    void addEnemy(const Board& board, const Pacman& enemy, int turnsSinceSeen) {
+        addThreat(board, enemy.pos, typeIndex(enemy.typeId), enemy.speedTurnsLeft, enemy.abilityCooldown, turnsSinceSeen);
+    }
+
+    /// An enemy of type enemyType (-1 if unknown) that was on pos turnsSinceSeen turns ago.
+    void addThreat(const Board& board, const Tile* pos, int enemyType, int speed, int cooldown, int turnsSinceSeen) {
+        for (Tile* tile : board.tileById) {
+            int dist = board.distance(pos, tile);
+            int arrival = turnsToCover(dist, speed);
+            if (speed == 0) {
+                // They may activate SPEED as soon as the cooldown allows.
+                arrival = min(arrival, turnsToCoverWithSpeedAfter(dist, cooldown));
+            }
+            // SWITCH costs a turn in which they don't move, and needs the cooldown to be over.
+            int switchArrival = max(arrival, cooldown) + 1;
+
+            arrival = max(0, arrival - turnsSinceSeen);
+            switchArrival = max(0, switchArrival - turnsSinceSeen);
+
+            for (int myType = 0; myType < 3; myType++) {
+                int threat = (enemyType == -1 || typeBeats(enemyType, myType)) ? arrival : switchArrival;
+                int& curr = threatTurn[myType][tile->id];
+                curr = min(curr, threat);
+            }
+        }
+    }
+
+    /// True if no enemy that can eat a pac of this type can be on this tile by the given turn.
+    bool isSafe(int myType, const Tile* tile, int turn) const {
+        if (myType == -1) return true;
+        return threatTurn[myType][tile->id] > turn;
+    }
+};
+// Two turns of cooldown: it walks 2 tiles, activates on turn 3, and covers the other 4 in turns 4 and 5.
+static_assert(DangerMap::turnsToCoverWithSpeedAfter(6, 2) == 5);
+
+
+/// Where the pacs of a team that already planned this step will be: which of them are on each tile at each of the next
+/// `window` turns, which pass over each tile at all, and which pellet each goes for first. Pacs that plan later look
+/// them up in O(1) instead of going through their teammates' routes.
+/// Pacs are bits (1 << pacId) in the masks, so that a pac can leave itself out and be taken out again.
+class ReservationTable {
+public:
+    static constexpr int window = TilePath::capacity + 1;   // Turns 0 to window-1.
+
+    static uint8_t bitOf(const Pacman& pac) {
+        assert(pac.pacId < 8);
+        return 1 << pac.pacId;
+    }
+
+    void reset(int numTiles) {
+        cells.assign(numTiles * window, 0);
+        passes.assign(numTiles, 0);
+        claims.assign(numTiles, 0);
+    }
+
+    void reserve(const Pacman& pac, const Route& route) {
+        mark(pac, route, bitOf(pac), 0xFF);
+    }
+
+    void release(const Pacman& pac, const Route& route) {
+        mark(pac, route, 0, ~bitOf(pac));
+    }
+
+    /// Pacs on the tile at the given turn.
+    uint8_t at(const Tile* tile, int turn) const {
+        return turn >= 0 && turn < window ? cells[tile->id * window + turn] : 0;
+    }
+
+    /// Pacs whose route goes over the tile.
+    uint8_t passing(const Tile* tile) const {
+        return passes[tile->id];
+    }
+
+    /// Pacs whose first pellet is on the tile.
+    uint8_t claiming(const Tile* tile) const {
+        return claims[tile->id];
+    }
+
+private:
+    void mark(const Pacman& pac, const Route& route, uint8_t set, uint8_t keep) {
+        // Routes leave out the tile the pac is on, which it is still on at turn 0. The check for two pacs trading
+        // places on the first move looks there.
+        uint8_t& start = cells[pac.pos->id * window];
+        start = (start & keep) | set;
+        for (int i = 0; i < route.fullPath.size(); i++) {
+            Tile* tile = route.fullPath[i];
+            int turn = DangerMap::turnsToCover(i + 1, pac.speedTurnsLeft);
+            if (turn < window) {
+                uint8_t& cell = cells[tile->id * window + turn];
+                cell = (cell & keep) | set;
+            }
+            passes[tile->id] = (passes[tile->id] & keep) | set;
+        }
+        if (route.firstPelletTile) {
+            claims[route.firstPelletTile->id] = (claims[route.firstPelletTile->id] & keep) | set;
+        }
+    }
+
+    vector<uint8_t> cells;  // [tile id * window + turn]
+    vector<uint8_t> passes; // [tile id]
+    vector<uint8_t> claims; // [tile id]
+};
+
+
+/// Occupancy distribution over tile ids for each alive enemy pac that is out of sight.
+/// Each step the distributions are propagated along the tile adjacency (one move per turn, two while sped up),
+/// then conditioned on our visibility (they are not on tiles we see) and on pellets that went missing (they were close by).
+class BeliefTracker {
+public:
+    struct Belief {
+        vector<float> p;    // [tile id]. Sums to 1.
+        int typeIndex = -1;     // -1 if never seen.
+        int speedTurnsLeft = 0;
+        int abilityCooldown = 0;
+        bool skipNextPredict = false;   // The position is of this step, not of the previous one.
+    };
+
+    map<int, Belief> beliefs;   // By enemy pacId.
+    vector<float> occupancy;    // Expected number of invisible enemy pacs on each tile. Sum of all beliefs.
+
+    float vanishedPelletRadius = 2;     // An enemy that ate a pellet last turn is at most this far from it.
+    float vanishedPelletWeight = 4.0;   // Likelihood ratio for tiles within the radius vs tiles outside it.
+
+    void forget(int pacId) {
+        beliefs.erase(pacId);
+    }
+
+    bool has(int pacId) const {
+        return beliefs.count(pacId) > 0;
+    }
+
+    /// Start tracking an enemy that was last seen on a tile (or uniformly anywhere out of sight if pos is null).
+    /// posIsCurrent means it is known to be on pos in this step rather than in the previous one.
+    void start(int pacId, const Board& board, const Tile* pos, int typeIdx, int speedTurnsLeft, int abilityCooldown, const vector<uint8_t>& visibleMask,
+               bool posIsCurrent = false) {
+        Belief& belief = beliefs[pacId];
+        belief.skipNextPredict = posIsCurrent;
+        belief.p.assign(board.numTiles(), 0.0f);
+        belief.typeIndex = typeIdx;
+        belief.speedTurnsLeft = speedTurnsLeft;
+        belief.abilityCooldown = abilityCooldown;
+        if (pos) {
+            belief.p[pos->id] = 1.0f;
+        }
+        else {
+            setUniformOutOfSight(belief, visibleMask);
+        }
+    }
+
+    /// One game turn of enemy movement: stay or step to a random neighbour.
+    void predict(const Board& board) {
+        vector<float> next(board.numTiles());
+        for (auto& [id, belief] : beliefs) {
+            if (belief.skipNextPredict) {
+                belief.skipNextPredict = false;
+                continue;
+            }
+            int moves = belief.speedTurnsLeft > 0 ? 2 : 1;
+            for (int m = 0; m < moves; m++) {
+                fill(next.begin(), next.end(), 0.0f);
+                const float* p = belief.p.data();
+                for (Tile* tile : board.tileById) {
+                    float share = p[tile->id] / (tile->neighbours.size() + 1);
+                    next[tile->id] += share;
+                    for (Tile* neighbour : tile->neighbours) {
+                        next[neighbour->id] += share;
+                    }
+                }
+                belief.p.swap(next);
+            }
+            belief.speedTurnsLeft = max(0, belief.speedTurnsLeft - 1);
+            belief.abilityCooldown = max(0, belief.abilityCooldown - 1);
+        }
+    }
+
+    /// visibleMask[tile id] is 1 where any of my pacs can see. vanishedPellets are pellets that no visible pac ate.
+    void observe(const Board& board, const vector<uint8_t>& visibleMask, const vector<Tile*>& vanishedPellets) {
+        int n = board.numTiles();
+        vector<float> likelihood(n, 1.0f);
+        for (int i = 0; i < n; i++) {
+            if (visibleMask[i]) likelihood[i] = 0.0f;
+        }
+        if (!vanishedPellets.empty()) {
+            for (Tile* tile : board.tileById) {
+                for (Tile* pellet : vanishedPellets) {
+                    if (board.distance(tile, pellet) <= vanishedPelletRadius) {
+                        likelihood[tile->id] *= vanishedPelletWeight;
+                        break;
+                    }
+                }
+            }
+        }
+
+        for (auto& [id, belief] : beliefs) {
+            float* p = belief.p.data();
+            const float* l = likelihood.data();
+            float total = 0.0f;
+            for (int i = 0; i < n; i++) {
+                p[i] *= l[i];
+                total += p[i];
+            }
+            if (total <= 1e-6f) {
+                // Our model lost them (e.g. they went somewhere it did not expect). Start over.
+                setUniformOutOfSight(belief, visibleMask);
+                continue;
+            }
+            float scale = 1.0f / total;
+            for (int i = 0; i < n; i++) {
+                p[i] *= scale;
+            }
+        }
+
+        occupancy.assign(n, 0.0f);
+        for (auto& [id, belief] : beliefs) {
+            const float* p = belief.p.data();
+            for (int i = 0; i < n; i++) {
+                occupancy[i] += p[i];
+            }
+        }
+    }
+
+    float occupancyAt(const Tile* tile) const {
+        return occupancy.empty() ? 0.0f : occupancy[tile->id];
+    }
+
+private:
+    void setUniformOutOfSight(Belief& belief, const vector<uint8_t>& visibleMask) {
+        int outOfSight = count(visibleMask.begin(), visibleMask.end(), 0);
+        for (int i = 0; i < int(belief.p.size()); i++) {
+            belief.p[i] = (visibleMask[i] || outOfSight == 0) ? 0.0f : 1.0f / outOfSight;
+        }
+    }
+};
+
+
+/// Groups of connected tiles that likely still hold a pellet. Relabelled by a BFS each step: the survival odds of the
+/// unknown pellets change all over the board every step, so any tile can join or leave a cluster.
+class PelletClusters {
+public:
+    float minSurvival = 0.5;    // Unknown pellets less likely than this to still be there are left out.
+
+    /// Id of the cluster's first tile, which stands for the cluster, or -1 if the tile holds no pellet.
+    int clusterOf(int tileId) const {
+        return rootOf[tileId];
+    }
+
+    const vector<int>& roots() const {
+        return clusterRoots;
+    }
+
+    /// Expected pellets in the cluster, super pellets counting 10.
+    float mass(int root) const {
+        return masses[root];
+    }
+
+    /// Tiles in the cluster.
+    int size(int root) const {
+        return counts[root];
+    }
+
+    void update(const Board& board) {
+        int n = board.numTiles();
+        rootOf.assign(n, -1);
+        masses.assign(n, 0);
+        counts.assign(n, 0);
+        clusterRoots.clear();
+        queue.clear();
+        for (Tile* start : board.tileById) {
+            if (rootOf[start->id] >= 0 || !holdsPellet(board, start)) continue;
+            int root = start->id;
+            clusterRoots.push_back(root);
+            rootOf[root] = root;
+            queue.assign(1, root);
+            for (int head = 0; head < int(queue.size()); head++) {
+                Tile* tile = board.tileById[queue[head]];
+                masses[root] += tile->getPelletValueAdjusted();
+                counts[root]++;
+                for (Tile* neighbour : tile->neighbours) {
+                    if (rootOf[neighbour->id] >= 0 || !holdsPellet(board, neighbour)) continue;
+                    rootOf[neighbour->id] = root;
+                    queue.push_back(neighbour->id);
+                }
+            }
+        }
+    }
+
+private:
+    bool holdsPellet(const Board& board, const Tile* tile) const {
+        return tile->pelletValue > 0 || (tile->pelletValue == -1 && board.pelletSurvival[tile->id] >= minSurvival);
+    }
+
+    vector<int> rootOf;     // [tile id]
+    vector<int> clusterRoots;
+    vector<float> masses;   // [root]
+    vector<int> counts;     // [root]
+    vector<int> queue;
+};
+
+
+/// Exhaustive search of a local fight between one of my pacs and the few enemy pacs close to it.
+/// Moves are simultaneous; each turn we assume they answer our action knowing it (maximin over pure actions),
+/// which is a safe lower bound on the real game. Iterative deepening until a deadline, with a transposition table.
+class CombatSolver {
+public:
+    static constexpr int maxPacs = 3;   // pacs[0] is my pac, the rest are enemies.
+    static constexpr int maxActions = 20;   // Stay, 4 steps with up to 3 second steps each, SPEED and 2 SWITCHes.
+    static constexpr int abilityCooldown = 10;
+    static constexpr int speedDuration = 5;
+
+    struct PacState {
+        int tile = -1;  // -1 if dead.
+        int type = -1;
+        int speed = 0;
+        int cooldown = 0;
+    };
+    struct State {
+        PacState pacs[maxPacs];
+        int numPacs = 0;
+    };
+    struct Action {
+        enum Kind { MOVE, SPEED, SWITCH } kind = MOVE;
+        int steps[2] = {-1, -1};    // Tile ids of the MOVE. -1 means no (further) step.
+        int switchType = -1;
+    };
+    using Actions = InlineVector<Action, maxActions>;
+    struct RootValue {
+        Action action;
+        double value;
+    };
+
+    const Board& board;
+    double deathValue = -100;
+    double killValue = 50;
+    double threatValue = 20;    // At the horizon: an enemy that could eat us next turn, or that we could eat.
+    double gamma = 0.9;     // Earlier outcomes are worth more.
+
+    int nodes = 0;
+    int depthReached = 0;
+    bool timedOut = false;
+
+    CombatSolver(const Board& board) : board(board), table(SearchArena::resource()) {}
+
+    /// Values of all my actions, from the deepest search that finished before the deadline.
+    pmr::vector<RootValue> solve(const State& root, int maxDepth, chrono::steady_clock::time_point deadline) {
+        this->deadline = deadline;
+        nodes = 0;
+        depthReached = 0;
+        timedOut = false;
+        table.clear();
+
+        pmr::vector<RootValue> result(SearchArena::resource());
+        for (int depth = 1; depth <= maxDepth; depth++) {
+            pmr::vector<RootValue> values(SearchArena::resource());
+            for (auto& action : actionsOf(root, 0)) {
+                values.push_back({action, valueOf(root, action, depth, -1e9)});
+                if (timedOut) break;
+            }
+            if (timedOut) break;
+            result = move(values);
+            depthReached = depth;
+        }
+        return result;
+    }
+
+    /// Kept inline, as there is a list of them for every pac at every node of the search.
+    Actions actionsOf(const State& state, int p) const {
+        const PacState& pac = state.pacs[p];
+        Actions actions;
+        if (pac.tile == -1) {
+            actions.push_back(Action());
+            return actions;
+        }
+
+        actions.push_back(Action());    // Stay.
+        for (Tile* n1 : board.tileById[pac.tile]->neighbours) {
+            Action action;
+            action.steps[0] = n1->id;
+            actions.push_back(action);
+            if (pac.speed > 0) {
+                for (Tile* n2 : n1->neighbours) {
+                    if (n2->id == pac.tile) continue;
+                    action.steps[1] = n2->id;
+                    actions.push_back(action);
+                }
+            }
+        }
+        if (pac.cooldown == 0) {
+            Action speed;
+            speed.kind = Action::SPEED;
+            actions.push_back(speed);
+            for (int type = 0; type < 3; type++) {
+                if (type == pac.type) continue;
+                Action sw;
+                sw.kind = Action::SWITCH;
+                sw.switchType = type;
+                actions.push_back(sw);
+            }
+        }
+        return actions;
+    }
+
+    /// Game rules for one turn: abilities first, then up to 2 movement sub-steps, each followed by eating.
+    State apply(const State& state, const Action* actions) const {
+        State next = state;
+        int n = state.numPacs;
+        for (int p = 0; p < n; p++) {
+            PacState& pac = next.pacs[p];
+            if (pac.tile == -1) continue;
+            if (actions[p].kind == Action::SWITCH) {
+                pac.type = actions[p].switchType;
+                pac.cooldown = abilityCooldown;
+            }
+            else if (actions[p].kind == Action::SPEED) {
+                pac.speed = speedDuration;
+                pac.cooldown = abilityCooldown;
+            }
+        }
+
+        for (int sub = 0; sub < 2; sub++) {
+            int from[maxPacs], to[maxPacs];
+            for (int p = 0; p < n; p++) {
+                from[p] = to[p] = next.pacs[p].tile;
+                bool canMove = sub == 0 || state.pacs[p].speed > 0;
+                if (from[p] != -1 && actions[p].kind == Action::MOVE && canMove && actions[p].steps[sub] != -1) {
+                    to[p] = actions[p].steps[sub];
+                }
+            }
+            // Pacs of the same type, or of the same team (all but pacs[0]), bump into each other and stay where they were.
+            for (int p = 0; p < n; p++) {
+                for (int q = p + 1; q < n; q++) {
+                    bool teammates = p > 0;
+                    if (from[p] == -1 || from[q] == -1 || (!teammates && next.pacs[p].type != next.pacs[q].type)) continue;
+                    if (to[p] == to[q] || (to[p] == from[q] && to[q] == from[p])) {
+                        to[p] = from[p];
+                        to[q] = from[q];
+                    }
+                }
+            }
+            for (int p = 0; p < n; p++) {
+                next.pacs[p].tile = to[p];
+            }
+            // Eating only happens between my pac and an enemy.
+            for (int q = 1; q < n; q++) {
+                PacState& me = next.pacs[0];
+                PacState& them = next.pacs[q];
+                if (me.tile == -1 || them.tile == -1) continue;
+                bool met = to[0] == to[q] || (to[0] == from[q] && to[q] == from[0]);
+                if (!met) continue;
+                if (typeBeats(me.type, them.type)) them.tile = -1;
+                else if (typeBeats(them.type, me.type)) me.tile = -1;
+            }
+        }
+
+        for (int p = 0; p < n; p++) {
+            next.pacs[p].speed = max(0, next.pacs[p].speed - 1);
+            next.pacs[p].cooldown = max(0, next.pacs[p].cooldown - 1);
+        }
+        return next;
+    }
+
+    double evaluate(const State& state) const {
+        const PacState& me = state.pacs[0];
+        if (me.tile == -1) return deathValue;
+
+        double value = 0;
+        for (int q = 1; q < state.numPacs; q++) {
+            const PacState& them = state.pacs[q];
+            if (them.tile == -1) {
+                value += killValue;
+                continue;
+            }
+            int dist = board.distance(board.tileById[me.tile], board.tileById[them.tile]);
+            bool theyCanEatUs = typeBeats(them.type, me.type) || them.cooldown == 0;
+            if (theyCanEatUs && dist <= (them.speed > 0 ? 2 : 1)) {
+                value -= threatValue;
+            }
+            else if (typeBeats(me.type, them.type) && them.cooldown > 0 && dist <= (me.speed > 0 ? 2 : 1)) {
+                value += threatValue / 2;
+            }
+        }
+        return value;
+    }
+
+private:
+    chrono::steady_clock::time_point deadline;
+    pmr::unordered_map<uint64_t, double> table;  // (state, depth) -> value.
 
-    Tile* firstStep() {
-        return fullPath.size() < 1 ? nullptr : fullPath[0];
+    static uint64_t mix(uint64_t h) {
+        h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+        return h ^ (h >> 33);
     }
-    Tile* secondStep() {
-        return fullPath.size() < 2 ? nullptr : fullPath[1];
+
+    static uint64_t hashOf(const State& state, int depth) {
+        uint64_t h = depth;
+        for (int p = 0; p < state.numPacs; p++) {
+            const PacState& pac = state.pacs[p];
+            h = mix(h ^ ((uint64_t)(pac.tile + 1) | (uint64_t)(pac.type + 1) << 16 | (uint64_t)pac.speed << 24 | (uint64_t)pac.cooldown << 32));
+        }
+        return h;
     }
-    bool empty() {
-        return fullPath.empty();
+
+    /// Value of my action, with the enemies picking their worst joint answer.
+    /// Stops early once it is no better than alpha, the best of my other actions so far.
+    double valueOf(const State& state, const Action& myAction, int depth, double alpha) {
+        int numEnemies = state.numPacs - 1;
+        Actions theirActions[maxPacs - 1];
+        for (int q = 0; q < numEnemies; q++) {
+            theirActions[q] = actionsOf(state, q + 1);
+        }
+
+        double worst = 1e9;
+        Action joint[maxPacs];
+        joint[0] = myAction;
+        int choice[maxPacs - 1] = {};
+        while (true) {
+            for (int q = 0; q < numEnemies; q++) {
+                joint[q + 1] = theirActions[q][choice[q]];
+            }
+            State next = apply(state, joint);
+            double value = search(next, depth - 1);
+            worst = min(worst, value);
+            if (worst <= alpha || timedOut) break;
+
+            int q = 0;
+            while (q < numEnemies && ++choice[q] == theirActions[q].size()) {
+                choice[q++] = 0;
+            }
+            if (q == numEnemies) break;
+        }
+        return worst;
     }
-    bool hasSuperPellets() {
-        return !superPellets.empty();
+
+    double search(const State& state, int depth) {
+        nodes++;
+        if ((nodes & 255) == 0 && chrono::steady_clock::now() > deadline) {
+            timedOut = true;
+        }
+        if (timedOut || depth == 0 || state.pacs[0].tile == -1) {
+            return evaluate(state);
+        }
+
+        uint64_t key = hashOf(state, depth);
+        auto cached = table.find(key);
+        if (cached != table.end()) return cached->second;
+
+        double best = -1e9;
+        for (auto& action : actionsOf(state, 0)) {
+            best = max(best, valueOf(state, action, depth, best));
+            if (timedOut) break;
+        }
+        // Outcomes further away are less certain.
+        double value = evaluate(state) * (1 - gamma) + best * gamma;
+        if (!timedOut) table[key] = value;
+        return value;
     }
-    friend ostream& operator<<(ostream& out, const Route& route);
 };
-ostream& operator<<(ostream& out, const Route& route) {
-    out << "Rt:" << setprecision(3) << route.totalReward << " ";
-    for (auto t : route.fullPath) {
-        if (t == route.firstPelletTile) out << "[";
-        if (t->getPelletValueAdjusted() == 10) out << "<";
-        out << t->toStr();
-        if (t->getPelletValueAdjusted() == 10) out << ">";
-        if (t == route.firstPelletTile) out << "]";
-        out << " ";
-    }
-    return out;
-}
 
 
-class Pacman {
+/// Picks one route for each of my pacs out of the candidates their own searches found (best first), with the highest
+/// total reward such that no two pacs are on a tile at the same turn, swap tiles in a turn, or go for the same first
+/// pellet. Collisions are only looked for in the first `window` turns, as the routes are planned again each step.
+/// Conflict-based search: a node of the tree gives each pac its best candidate that keeps to the node's constraints.
+/// The earliest conflict between two of its pacs splits it in two, each forbidding it to one of the pacs, and nodes
+/// are expanded best total first, so the first node without conflicts is the best joint plan.
+class ConflictSearch {
 public:
-    int pacId; // pac number (unique within a team)
-    bool mine; // true if this pac is yours
-    Tile* pos;
-    string typeId; // unused in wood leagues
-    int speedTurnsLeft; // unused in wood leagues
-    int abilityCooldown; // unused in wood leagues
-
-    const Board& board;
-    bool visible = true;    // Can be false for enemy pacs
-    unordered_map<Tile*, int> distanceToTile;
+    struct Constraint {
+        enum Kind { VERTEX, SWAP, CLAIM } kind;
+        int pac;            // Index into the pacs given to solve.
+        int tile;           // VERTEX: the tile. SWAP: the tile moved from. CLAIM: the first pellet.
+        int toTile = -1;    // SWAP: the tile moved to.
+        int turn = -1;      // VERTEX and SWAP: the turn of getting there.
+    };
 
-    Route route;    // Will change each step.
+    double noRouteReward = -1000;   // For a pac whose candidates all break its constraints.
+    int window = 8;
+
+    int nodes = 0;
+    int conflicts = 0;
+    bool outOfBudget = false;
+
+    /// For each pac, the index of its route in candidates, or -1 for none. Nothing if the budget ran out first.
+    optional<vector<int>> solve(const vector<const Pacman*>& pacs, const vector<const pmr::vector<Route>*>& candidates,
+                                int maxNodes, chrono::steady_clock::time_point deadline) {
+        this->pacs = &pacs;
+        this->candidates = &candidates;
+        nodes = conflicts = 0;
+        outOfBudget = false;
+        int n = pacs.size();
+
+        Node root;
+        for (int p = 0; p < n; p++) {
+            root.choice.push_back(pick(p, root.constraints));
+            root.total += rewardOf(p, root.choice[p]);
+        }
+        auto worse = [](const Node& a, const Node& b) { return a.total < b.total; };
+        priority_queue<Node, pmr::vector<Node>, decltype(worse)> open(worse, pmr::vector<Node>(SearchArena::resource()));
+        open.push(move(root));
+
+        while (!open.empty()) {
+            if (nodes >= maxNodes || chrono::steady_clock::now() > deadline) {
+                outOfBudget = true;
+                return nullopt;
+            }
+            Node node = open.top(); open.pop();
+            nodes++;
+
+            optional<pair<Constraint, Constraint>> conflict = firstConflict(node.choice);
+            if (!conflict) return node.choice;
+            conflicts++;
+
+            for (const Constraint& constraint : {conflict->first, conflict->second}) {
+                Node child = node;
+                child.constraints.push_back(constraint);
+                int p = constraint.pac;
+                child.total -= rewardOf(p, child.choice[p]);
+                child.choice[p] = pick(p, child.constraints);
+                child.total += rewardOf(p, child.choice[p]);
+                open.push(move(child));
+            }
+        }
+        return nullopt;     // Not reached: a node that picks no route for every pac has no conflicts.
+    }
 
-    Pacman(int pacId, int mine, Tile* pos, string typeId, int speedTurnsLeft, int abilityCooldown, const Board& b)
-     : pacId(pacId), mine(mine), pos(pos), typeId(typeId), speedTurnsLeft(speedTurnsLeft), abilityCooldown(abilityCooldown), board(b)
-     {}
+private:
+    struct Node {
+        pmr::vector<Constraint> constraints;
+        vector<int> choice;
+        double total = 0;
+    };
 
-    unordered_set<Tile*> getVisibleTiles() {
-        unordered_set<Tile*> visibleTiles;
-        dfs(pos, visibleTiles);
-        return visibleTiles;
-    }
+    /// Where a pac is after each step of a route: getting from tile `from` to tile `to` at turn `turn`.
+    struct Step {
+        int turn, from, to;
+    };
 
-    bool operator<(const Pacman& other) {
-        return pacId < other.pacId;
-    }
+    const vector<const Pacman*>* pacs;
+    const vector<const pmr::vector<Route>*>* candidates;
 
-    bool isSpeedActive() {
-        return speedTurnsLeft > 0;
+    const Route* routeOf(int p, int choice) const {
+        return choice == -1 ? nullptr : &(*(*candidates)[p])[choice];
     }
 
-    Tile* getClaimedTile() {    // Return the pellet tile claimed by this pac on its boundary of pellets
-        return route.firstPelletTile;
+    double rewardOf(int p, int choice) const {
+        return choice == -1 ? noRouteReward : routeOf(p, choice)->totalReward;
     }
 
-    Tile* getMoveDestination() {
-        if (isSpeedActive()) {
-            auto ret = route.secondStep();
-            if (!ret) ret = route.firstStep();
-            return ret;
-        }
-        else {
-            return route.firstStep();
+    pmr::vector<Step> stepsOf(int p, int choice) const {
+        pmr::vector<Step> steps(SearchArena::resource());
+        const Route* route = routeOf(p, choice);
+        if (!route) return steps;
+        const Pacman& pac = *(*pacs)[p];
+        int from = pac.pos->id;
+        for (int i = 0; i < route->fullPath.size(); i++) {
+            int turn = DangerMap::turnsToCover(i + 1, pac.speedTurnsLeft);
+            if (turn > window) break;
+            steps.push_back({turn, from, route->fullPath[i]->id});
+            from = steps.back().to;
         }
+        return steps;
     }
 
-    Tile* getClosestSuperPellet() {
-        int minDist = 9999;
-        Tile* closest = nullptr;
-        for (auto t : board.superPelletTiles) {
-            if (t->pelletValue == 10) {
-                if (distanceToTile[t] < minDist) {
-                    minDist = distanceToTile[t];
-                    closest = t;
-                }
+    bool keepsTo(int p, int choice, const pmr::vector<Constraint>& constraints) const {
+        const Route& route = *routeOf(p, choice);
+        pmr::vector<Step> steps = stepsOf(p, choice);
+        for (const Constraint& c : constraints) {
+            if (c.pac != p) continue;
+            if (c.kind == Constraint::CLAIM) {
+                if (route.firstPelletTile && route.firstPelletTile->id == c.tile) return false;
+                continue;
+            }
+            for (const Step& step : steps) {
+                if (step.turn != c.turn) continue;
+                if (c.kind == Constraint::VERTEX && step.to == c.tile) return false;
+                if (c.kind == Constraint::SWAP && step.from == c.tile && step.to == c.toTile) return false;
             }
         }
-        return closest;
+        return true;
     }
 
-    string routeToStr() {
-        stringstream out;
-        out << "Rt:" << setprecision(3) << route.totalReward << "";
-        for (auto t : route.fullPath) {
-            if (t == getClaimedTile()) out << "[";
-            if (t == getMoveDestination()) out << "{";
-            if (t->getPelletValueAdjusted() == 10) out << "<";
-            if (t->pacOnTile) out << "|";
-            out << t->toStr();
-            if (t->pacOnTile) out << "|";
-            if (t->getPelletValueAdjusted() == 10) out << ">";
-            if (t == getMoveDestination()) out << "}";
-            if (t == getClaimedTile()) out << "]";
-            out << " ";
+    /// The best candidate of pac p that keeps to the constraints, -1 if there is none.
+    int pick(int p, const pmr::vector<Constraint>& constraints) const {
+        int numCandidates = (*candidates)[p]->size();
+        for (int choice = 0; choice < numCandidates; choice++) {
+            if (keepsTo(p, choice, constraints)) return choice;
         }
-        return out.str();
+        return -1;
     }
 
-private:
-    void dfs(Tile* tile, unordered_set<Tile*>& visibleTiles) {
-        if (tile->x == pos->x || tile->y == pos->y) {
-            visibleTiles.insert(tile);
-
-            for (auto n : tile->neighbours) {
-                if(visibleTiles.count(n) == 0) {
-                    dfs(n, visibleTiles);
+    /// The earliest collision between two of the chosen routes, as the constraint that avoids it for each of the two
+    /// pacs. Same first pellets come after collisions.
+    optional<pair<Constraint, Constraint>> firstConflict(const vector<int>& choice) const {
+        int n = choice.size();
+        pmr::vector<pmr::vector<Step>> steps(SearchArena::resource());
+        for (int p = 0; p < n; p++) steps.push_back(stepsOf(p, choice[p]));
+
+        optional<pair<Constraint, Constraint>> earliest;
+        for (int a = 0; a < n; a++) {
+            for (int b = a + 1; b < n; b++) {
+                for (const Step& sa : steps[a]) {
+                    if (earliest && sa.turn >= earliest->first.turn) break;
+                    for (const Step& sb : steps[b]) {
+                        if (sb.turn != sa.turn) continue;
+                        if (sa.to == sb.to) {
+                            earliest = {{Constraint::VERTEX, a, sa.to, -1, sa.turn}, {Constraint::VERTEX, b, sb.to, -1, sb.turn}};
+                        }
+                        else if (sa.from == sb.to && sa.to == sb.from) {
+                            earliest = {{Constraint::SWAP, a, sa.from, sa.to, sa.turn}, {Constraint::SWAP, b, sb.from, sb.to, sb.turn}};
+                        }
+                    }
+                }
+            }
+        }
+        if (earliest) return earliest;
+
+        for (int a = 0; a < n; a++) {
+            for (int b = a + 1; b < n; b++) {
+                const Route* ra = routeOf(a, choice[a]);
+                const Route* rb = routeOf(b, choice[b]);
+                if (ra && rb && ra->firstPelletTile && ra->firstPelletTile == rb->firstPelletTile) {
+                    int tile = ra->firstPelletTile->id;
+                    return pair<Constraint, Constraint>{{Constraint::CLAIM, a, tile}, {Constraint::CLAIM, b, tile}};
                 }
             }
         }
+        return nullopt;
     }
-
-    friend ostream& operator<<(ostream& out, const Pacman& pac);
 };
-ostream& operator<<(ostream& out, const Pacman& pac) {
-    out << "Pacman: " << "Id:"<< pac.pacId << " x:"<< pac.pos->x << " y:" << pac.pos->y << " mine:" << pac.mine;
-    return out;
-}
 
 
 class Game {    // Main class, like the Solution class.
@@ -342,6 +1973,7 @@ public:
     map<int, Pacman> myDeadPacs;
     map<int, Pacman> theirDeadPacs;
     int visiblePelletCount; // all pellets in sight
+    uint64_t pacHash = 0;   // Zobrist hash of the last known position, type and speed of all alive pacs. Kept up to date by input().
 
     Board board;
 
@@ -358,6 +1990,66 @@ public:
 
     map<Pacman*, unordered_map<Tile*, int>> pacDistances;   // Flood-fill distances from each pac in each step.
 
+    DangerMap danger;   // Rebuilt each step.
+    BeliefTracker beliefs;  // Where the enemy pacs that we can't see probably are.
+    float beliefDangerThreshold = 0.25;     // Tiles where an invisible enemy is at least this likely to be count as threats.
+
+    // Prediction of visible enemies' routes, by running our own planner from their point of view.
+    int opponentPlanHorizon = 10;
+    int opponentPlanNodeBudget = 3000;  // Per visible enemy, over all of its frontier paths.
+    double opponentPlanConfidence = 0.5;    // How much we trust that they follow the predicted route.
+    vector<int> enemyPlanTurn;  // [tile id] -> earliest turn a visible enemy is predicted to be on it. Rebuilt each step.
+    vector<int> enemyPlanType;  // [tile id] -> typeIndex of that enemy.
+
+    // Local fights are solved exactly by the CombatSolver instead of the step_switch / step_speedUp heuristics.
+    int combatRadius = 4;   // Enemies this close to a pac make it a fight.
+    int combatMaxDepth = 4;
+    int combatTimeBudgetUs = 4500;
+
+    // How my pacs plan when there are several: one after the other, together (see planPacsJointly), or in parallel
+    // (see planPacsInParallel; threaded builds only, others plan one after the other).
+    enum class PlanMode { sequential, joint, parallel };
+#ifdef PACMAN_THREADS
+    PlanMode planMode = PlanMode::parallel;
+#else
+    PlanMode planMode = PlanMode::joint;
+#endif
+    int conflictSearchBudgetUs = 3000;  // For the ConflictSearch alone, once every pac has its candidates.
+    int conflictSearchMaxNodes = 2000;
+    int conflictWindowTurns = 8;    // Collisions further ahead than this are left to later steps.
+    vector<string> typeNames = {"ROCK", "PAPER", "SCISSORS"};
+
+    // Pacs head for pellet clusters; the route search does not start toward the clusters of the others.
+    bool clusterPlanning = true;
+    PelletClusters clusters;
+    map<int, int> clusterTargets;   // pacId -> root tile id of the cluster it heads for. Rebuilt each step.
+
+    int precomputeTimeBudgetMs = 700;   // Out of the 1000ms of the first turn; the rest is for the first step itself.
+    size_t precomputeMemoryBudgetBytes = 64 << 20;
+
+    // When few pellets are left, tours are solved exactly instead of searched for.
+    int endgamePelletThreshold = 10;    // Expected pellets left at which the endgame solver takes over. Also the most pellets it solves for.
+    double endgameMinSurvival = 0.5;    // Unknown pellets less likely than this to still be there are left out of the tours.
+    map<int, vector<Tile*>> endgameTours;   // pacId -> pellets to eat, in order. Empty when not in the endgame. Rebuilt each step.
+    int enemyMemoryTurns = 3;   // How long an enemy pac that went out of sight still counts as a threat from its last seen tile.
+
+    Route noRoute;
+    bool planningOnSnapshot = false;    // Set while pacs plan in parallel; see plannedRouteOf.
+    array<ReservationTable, 2> reservations;    // [pac.mine] See reservationsOf.
+    static inline thread_local ostream* planLog = &cerr;
+#ifdef PACMAN_THREADS
+    unique_ptr<WorkStealingPool> pool = make_unique<WorkStealingPool>(PACMAN_THREADS);
+#endif
+
+    int routeCandidates = 64;   // Best routes per pac kept from the search, for the passes that rescore them.
+    int planNodeBudget = 20000;     // Per pac and step, in turns, over all of its frontier paths.
+    int maxFrontierTargets = 0;     // Frontier pellets a pac's route search starts toward, best first. 0 for all.
+    using RoutePolicy = RewardPolicy<880, 2 * TilePath::capacity>;  // Twice the path length, for routes that walk back out of a dead end.
+    SearchArena searchArena{32 << 20};
+    TranspositionTable routeTable{1 << 16};     // 2 MB.
+    int minTableSteps = 4;  // The route search only uses the table for states with at least this many steps left.
+    int laterWayShare = 8;  // See nodesForFirstOf.
+
     Game() {}
 
     void buildBoard(vector<string>& grid) {
@@ -396,6 +2088,71 @@ public:
                 }
             }
         }
+
+        for (auto& [coord, tile] : board.tiles) {
+            tile.id = board.tileById.size();
+            board.tileById.push_back(&tile);
+        }
+        TilePath::tiles = board.tileById.data();
+        if (board.numTiles() > TilePath::maxTiles) throw length_error("Board has more tiles than TilePath::maxTiles");
+        assert(board.numTiles() < TranspositionTable::noTile);
+    }
+
+    /// Builds the static tables of the board. Runs once, right after buildBoard, in the 1000ms budget of the first turn.
+    /// Symmetry and distances are read by the other stages and by most of the bot, so they are always built; they
+    /// take a few milliseconds and under a megabyte on the largest maps. Every other table is optional: one that
+    /// would not fit in the memory budget, or that would start or run past the time budget, is skipped (or given up
+    /// on and emptied), and its lookups fall back to something cheap: walking the line of sight, no pocket, or a
+    /// looser search bound. Optional tables only read the required ones, so skipping one never breaks another.
+    void precompute(const vector<string>& grid) {
+        struct Stage {
+            string name;
+            bool required;
+            function<size_t()> estimatedBytes;  // Evaluated right before the stage, so it can use the tables built before it.
+            function<bool(chrono::steady_clock::time_point)> build;  // False when it gave up at the deadline.
+            function<size_t()> bytes;
+        };
+        size_t n = board.numTiles();
+        vector<Stage> stages = {
+            {"symmetry", true, [&]() { return n * 2 * sizeof(int); },
+                [&](auto) { board.detectSymmetry(grid); return true; },
+                [&]() { return (board.mirrorId.capacity() + board.tableRow.capacity()) * sizeof(int); }},
+            {"distances", true, [&]() { return board.numTableRows * n * sizeof(uint16_t); },
+                [&](auto) { board.buildDistanceTable(); return true; },
+                [&]() { return board.distances.capacity() * sizeof(uint16_t); }},
+            {"visibility", false, [&]() { return board.numTableRows * (board.width + board.height) * sizeof(int); },
+                [&](auto deadline) { return board.buildVisibilityTable(deadline); },
+                [&]() { return board.visibilityTableBytes(); }},
+            {"deadEnds", false, [&]() { return n * 3 * sizeof(int); },
+                [&](auto) { board.buildDeadEndTables(); return true; },    // Linear in the tiles.
+                [&]() { return board.deadEndTableBytes(); }},
+            {"pelletMass", false, [&]() { return n * (2 * Board::massRadius * (Board::massRadius + 1) + 1) * sizeof(Board::BallTile) + n * (Board::massRadius + 1) * sizeof(double); },
+                [&](auto deadline) { return board.buildPelletMassField(deadline); },
+                [&]() { return board.pelletMassFieldBytes(); }},
+        };
+
+        auto startTime = chrono::steady_clock::now();
+        auto deadline = startTime + chrono::milliseconds(precomputeTimeBudgetMs);
+        size_t totalBytes = 0;
+        for (auto& stage : stages) {
+            auto stageStart = chrono::steady_clock::now();
+            auto spentMs = chrono::duration_cast<chrono::milliseconds>(stageStart - startTime).count();
+            size_t estimatedBytes = stage.estimatedBytes();
+            if (!stage.required && (stageStart > deadline || totalBytes + estimatedBytes > precomputeMemoryBudgetBytes)) {
+                cerr << "Precompute: skipped " << stage.name << " (spent " << spentMs << "ms, " << totalBytes / 1024 << "KB, needs ~" << estimatedBytes / 1024 << "KB)" << endl;
+                continue;
+            }
+            if (!stage.build(deadline)) {
+                cerr << "Precompute: gave up on " << stage.name << " at the time budget" << endl;
+                continue;
+            }
+            size_t bytes = stage.bytes();
+            totalBytes += bytes;
+            auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - stageStart).count();
+            cerr << "Precompute: " << stage.name << " " << elapsed << "us " << bytes / 1024 << "KB" << endl;
+        }
+        auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - startTime).count();
+        cerr << "Precompute: done in " << elapsed << "us, " << totalBytes / 1024 << "KB. Tiles: " << n << " Mirrored: " << board.mirrored << endl;
     }
 
     // Runs before input.
@@ -419,12 +2176,16 @@ public:
         }
     }
 
-    /// Marks pellets for all tiles to be unknown (-1) except for the ones that are known to be gone (0).
-    /// This function must be run BEFORE receiving input of visible pellets.
-    void clearPellets() {
-        for (auto& [_, tile] : board.tiles) {
-            if(tile.pelletValue != 0) {
-                tile.pelletValue = -1;
+    /// Sets the visible pellets of the input, and marks the pellets of all other tiles to be unknown (-1) except for
+    /// the ones that are known to be gone (0). Each tile is set once, to its new value, so that only the ones that
+    /// change touch pelletHash.
+    void updatePellets(const vector<pair<Tile*, int>>& visiblePellets) {
+        vector<int> visibleValue(board.numTiles(), -1);
+        for (auto& [tile, value] : visiblePellets) visibleValue[tile->id] = value;
+        for (Tile* tile : board.tileById) {
+            tile->prevPelletValue = tile->pelletValue;
+            if (tile->pelletValue != 0 || visibleValue[tile->id] != -1) {
+                board.setPelletValue(tile, visibleValue[tile->id]);
             }
         }
     }
@@ -437,14 +2198,27 @@ public:
             auto visibleTiles = pac.getVisibleTiles();
             for (Tile* tile : visibleTiles) {
                 if (tile->pelletValue == -1) {
-                    tile->pelletValue = 0;
+                    board.setPelletValue(tile, 0);
                 }
             }
         }
 
         for (Tile* tile: board.superPelletTiles) {
             if (tile->pelletValue == -1) {
-                tile->pelletValue = 0;
+                board.setPelletValue(tile, 0);
+            }
+        }
+    }
+
+    /// Runs after updateGonePellets. On a mirrored map, the initial pellets are mirrored too: in the first step,
+    /// a visible tile without a pellet (e.g. a start position of my pacs) means its twin has none either
+    /// (e.g. the start positions of their pacs). A visible pellet implies its twin had one, which is the default expectation.
+    void applySymmetryInference() {
+        if (!board.mirrored || gameSteps != 0) return;
+
+        for (Tile* tile : board.tileById) {
+            if (tile->pelletValue == 0) {
+                board.setPelletValue(board.mirrorOf(tile), 0);
             }
         }
     }
@@ -499,7 +2273,7 @@ public:
 
                     while(!q.empty() && steps < gameSteps) {
                         Tile* curr = q.front(); q.pop(); 
-                        curr->pelletValue = 0;
+                        board.setPelletValue(curr, 0);
                         
                         if (curr->neighbours.size() == 2) {
                             for (auto& neighbour : curr->neighbours) {
@@ -518,9 +2292,78 @@ public:
         }
     }
 
+    /// Runs after input, once gone pellets are known.
+    void updateEnemyBeliefs() {
+        auto startTime = chrono::steady_clock::now();
+
+        vector<uint8_t> visibleMask(board.numTiles(), 0);
+        for (auto& [id, pac] : myPacs) {
+            board.forEachVisible(pac.pos, [&](int tileId) {
+                visibleMask[tileId] = 1;
+            });
+        }
+
+        // Pellets we saw in the last step that are gone now, and that none of the pacs we can see could have eaten.
+        vector<Tile*> vanishedPellets;
+        for (Tile* tile : board.tileById) {
+            if (tile->prevPelletValue > 0 && tile->pelletValue == 0) {
+                bool explained = false;
+                for (auto& [id, pac] : myPacs) {
+                    explained = explained || board.distance(pac.pos, tile) <= 2;
+                }
+                for (auto& [id, pac] : theirVisiblePacs) {
+                    explained = explained || board.distance(pac.pos, tile) <= 2;
+                }
+                if (!explained) {
+                    vanishedPellets.push_back(tile);
+                }
+            }
+        }
+
+        // Both teams have the same pac ids.
+        set<int> enemyIds;
+        for (auto& [id, _] : myPacs) enemyIds.insert(id);
+        for (auto& [id, _] : myDeadPacs) enemyIds.insert(id);
+
+        for (int id : enemyIds) {
+            auto theirPac = theirPacs.find(id);
+            bool visible = theirPac != theirPacs.end() && theirPac->second.visible;
+            if (visible || theirDeadPacs.count(id) > 0) {
+                beliefs.forget(id);
+            }
+            else if (!beliefs.has(id)) {
+                if (theirPac != theirPacs.end()) {
+                    Pacman& pac = theirPac->second;
+                    beliefs.start(id, board, pac.pos, typeIndex(pac.typeId), pac.speedTurnsLeft, pac.abilityCooldown, visibleMask);
+                }
+                else if (gameSteps == 0 && board.mirrored && myPacs.count(id)) {
+                    // Both teams start mirrored, with the same types.
+                    Pacman& mine = myPacs.at(id);
+                    beliefs.start(id, board, board.mirrorOf(mine.pos), typeIndex(mine.typeId), 0, 0, visibleMask, true);
+                }
+                else {
+                    beliefs.start(id, board, nullptr, -1, 0, 0, visibleMask);
+                }
+            }
+        }
+
+        beliefs.predict(board);
+        beliefs.observe(board, visibleMask, vanishedPellets);
+
+        auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - startTime).count();
+        cerr << "Beliefs: " << beliefs.beliefs.size() << " enemies, " << vanishedPellets.size() << " vanished pellets, " << elapsed << "us" << endl;
+    }
+
+    /// Uses the predicted route of the visible enemies when there is one, else guesses from the pellets around them.
     void estimateTheirDestinations(PacDestinationT& theirPacDestinations) {
-        for (auto& [id, pac] : theirVisiblePacs) {
-            
+        for (auto& [id, pac] : theirPacs) {
+            if (!pac.visible) continue;
+
+            if (!pac.route.empty()) {
+                theirPacDestinations.emplace(pac.getMoveDestination(), &pac);
+                continue;
+            }
+
             bool noPelletNeighbours = all_of(pac.pos->neighbours.begin(), pac.pos->neighbours.end(),
                 [](Tile* t) {
                     return t->pelletValue == 0;
@@ -540,6 +2383,62 @@ public:
 
         }
     }
+    /// Plan for a visible enemy as if it were one of ours, with a shorter horizon and its own node budget.
+    Route predictRouteOf(Pacman& theirPac) {
+        Frontier frontier = closestPelletsFrontier(theirPac);
+
+        TopRoutes best(1);
+        SearchLimits limits;
+        limits.table = &routeTable;
+        limits.generation = routeTable.newGeneration();
+        limits.onlyBest = true;
+        for (int target : frontier.targets) {  // Closest first, so the budget goes to the likeliest targets.
+            limits.maxNodes = opponentPlanNodeBudget - limits.nodesExpanded;
+            if (limits.maxNodes <= 0) break;
+            extendPathIntoRouteOfN(pathTo(frontier, target), opponentPlanHorizon, theirPac, limits, best);
+        }
+        return best.empty() ? Route() : best.takeSorted()[0];
+    }
+
+    /// Runs before my pacs plan. Predicted routes make their pellets less valuable to us when they get there first,
+    /// and tell the route search where collisions are likely.
+    void predictTheirRoutes() {
+        auto startTime = chrono::steady_clock::now();
+
+        enemyPlanTurn.assign(board.numTiles(), DangerMap::never);
+        enemyPlanType.assign(board.numTiles(), -1);
+        reservations[false].reset(board.numTiles());
+        for (auto& [id, pac] : theirPacs) {
+            pac.route = Route();
+        }
+
+        for (auto& [id, pac] : theirPacs) {
+            if (!pac.visible) continue;
+            commitRoute(pac, predictRouteOf(pac));
+
+            for (int i = 0; i < pac.route.fullPath.size(); i++) {
+                Tile* tile = pac.route.fullPath[i];
+                int turn = DangerMap::turnsToCover(i + 1, pac.speedTurnsLeft);
+                if (turn < enemyPlanTurn[tile->id]) {
+                    enemyPlanTurn[tile->id] = turn;
+                    enemyPlanType[tile->id] = typeIndex(pac.typeId);
+                }
+
+                int myClosest = DangerMap::never;
+                for (auto& [myId, myPac] : myPacs) {
+                    myClosest = min(myClosest, DangerMap::turnsToCover(board.distance(myPac.pos, tile), myPac.speedTurnsLeft));
+                }
+                if (turn < myClosest) {
+                    board.setPelletValueAdjusted(tile, tile->pelletValueAdjusted * (1.0 - opponentPlanConfidence));
+                }
+            }
+            cerr << "Opp" << id << " predicted " << pac.route << endl;
+        }
+
+        auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - startTime).count();
+        cerr << "Predicted their routes in " << elapsed << "us" << endl;
+    }
+
     void printPacDestinations(PacDestinationT& pacDestinations) {
         multimap<Pacman*, Tile*> tempmap;
         for (auto [tile, pac] : pacDestinations) {
@@ -567,24 +2466,23 @@ public:
 
     void floodFillFromPacmansAndCache() {
         for (auto& [_, pac] : myPacs) {
-            queue<Tile*> q;
-            unordered_map<Tile*, int> discoveredDistances;
+            queue<Tile*, pmr::deque<Tile*>> q(pmr::deque<Tile*>(SearchArena::resource()));
+            vector<int>& discoveredDistances = pac.distanceToTile;
+            discoveredDistances.assign(board.numTiles(), -1);   // Keeps its capacity from the last step.
 
             q.push(pac.pos);
-            discoveredDistances.emplace(pac.pos, 0);
+            discoveredDistances[pac.pos->id] = 0;
 
             while(!q.empty()) {
                 Tile* currTile = q.front(); q.pop();
 
                 for (Tile* n : currTile->neighbours) {
-                    if (discoveredDistances.count(n) == 0) {
-                        discoveredDistances[n] = discoveredDistances.at(currTile) + 1;
+                    if (discoveredDistances[n->id] == -1) {
+                        discoveredDistances[n->id] = discoveredDistances[currTile->id] + 1;
                         q.push(n);
                     }
                 }
             }
-
-            pac.distanceToTile = move(discoveredDistances);
         }
     }
 
@@ -611,70 +2509,425 @@ public:
         }
     }
 
-    Pacman* tileClaimedByPac(Tile* tile) {
-        for (auto& [_, pac] : myPacs) {
-            if (tile == pac.getClaimedTile()) {
-                return &pac;
+    /// Runs before planning. Visible enemies, enemies seen within the last enemyMemoryTurns steps,
+    /// and likely positions of the other invisible enemies are threats.
+    void updateDangerMap() {
+        danger.reset(board.numTiles());
+        for (auto& [id, pac] : theirPacs) {
+            int turnsSinceSeen = gameSteps - pac.lastSeenStep;
+            if (turnsSinceSeen > enemyMemoryTurns) continue;
+            danger.addEnemy(board, pac, turnsSinceSeen);
+        }
+        for (auto& [id, belief] : beliefs.beliefs) {
+            for (Tile* tile : board.tileById) {
+                if (belief.p[tile->id] >= beliefDangerThreshold) {
+                    danger.addThreat(board, tile, belief.typeIndex, belief.speedTurnsLeft, belief.abilityCooldown, 0);
+                }
             }
         }
-        return nullptr;
     }
 
-    bool isAnyPacsFirstStep(Tile* tile) {
-        for (auto& [_, pac] : myPacs) {
-            if (tile == pac.route.firstStep()) {
-                return true;
+    /// Turn at which mypac would reach the tile that is pathLength tiles away.
+    int turnsToReach(const Pacman& mypac, int pathLength) {
+        return DangerMap::turnsToCover(pathLength, mypac.speedTurnsLeft);
+    }
+
+    /// Current tile or neighbour which the enemies that can eat mypac would get to the latest.
+    Tile* safestStepFor(Pacman& mypac) {
+        int myType = typeIndex(mypac.typeId);
+        Tile* safest = mypac.pos;
+        for (Tile* neighbour : mypac.pos->neighbours) {
+            if (neighbour->pacOnTile && neighbour->pacOnTile->mine) continue;
+            if (danger.threatTurn[myType][neighbour->id] > danger.threatTurn[myType][safest->id]) {
+                safest = neighbour;
             }
         }
+        return safest;
+    }
+
+    /// My pacs for my pacs, their pacs for theirs.
+    map<int, Pacman>& teamOf(const Pacman& pac) {
+        return pac.mine ? myPacs : theirPacs;
+    }
+
+    /// The route of a teammate, as pac should see it while planning: nothing for pac itself, and last step's route
+    /// while pacs plan in parallel, since their current ones are being written by other threads.
+    const Route& plannedRouteOf(const Pacman& teammate, const Pacman& pac) {
+        if (&teammate == &pac) return noRoute;
+        return planningOnSnapshot ? teammate.prevRoute : teammate.route;
+    }
+
+    /// Routes planned so far this step by pac's team. While pacs plan in parallel, last step's routes, as for plannedRouteOf.
+    ReservationTable& reservationsOf(const Pacman& pac) {
+        return reservations[pac.mine];
+    }
+
+    /// Sets pac's route and reserves it for its teammates to see, unless pacs plan in parallel: they see a snapshot.
+    void commitRoute(Pacman& pac, const Route& route) {
+        pac.route = route;
+        if (!planningOnSnapshot) reservationsOf(pac).reserve(pac, pac.route);
+    }
+
+    /// What is still ahead of pac on a route it planned last step and has since moved one or two tiles along, so that
+    /// it starts next to where pac is now. Empty if pac left the route.
+    Route routeAheadOf(const Pacman& pac, const Route& route) {
+        const TilePath& path = route.fullPath;
+        auto it = find(path.begin(), path.end(), pac.pos);
+        if (it == path.end()) return Route();
+        Route ahead;
+        ahead.fullPath = TilePath(++it, path.end());
+        ahead.horizon = route.horizon;
+        if (find(ahead.fullPath.begin(), ahead.fullPath.end(), route.firstPelletTile) != ahead.fullPath.end()) {
+            ahead.firstPelletTile = route.firstPelletTile;  // Unless pac already ate it.
+        }
+        return ahead;
+    }
+
+    /// True if the route goes for a pellet a teammate claimed, or meets a teammate on a tile or coming the other way
+    /// within the first conflictWindowTurns turns, as the ConflictSearch would see it.
+    bool collidesWithTeammates(const Pacman& pac, const Route& route) {
+        if (route.firstPelletTile && tileClaimedByPac(route.firstPelletTile, pac)) return true;
+        const ReservationTable& table = reservationsOf(pac);
+        Tile* from = pac.pos;
+        for (int i = 0; i < route.fullPath.size(); i++) {
+            Tile* tile = route.fullPath[i];
+            int turn = turnsToReach(pac, i + 1);
+            if (turn > conflictWindowTurns) break;
+            if (table.at(tile, turn) & ~ReservationTable::bitOf(pac)) return true;
+            if (table.at(from, turn) & table.at(tile, turn - 1) & ~ReservationTable::bitOf(pac)) return true;
+            from = tile;
+        }
         return false;
     }
 
+    /// Takes back the route of commitRoute, for a pac that ends up doing something else.
+    void withdrawRoute(Pacman& pac) {
+        if (!planningOnSnapshot) reservationsOf(pac).release(pac, pac.route);
+        pac.route = Route();
+    }
+
+    bool tileClaimedByPac(Tile* tile, const Pacman& pac) {
+        return reservationsOf(pac).claiming(tile) & ~ReservationTable::bitOf(pac);
+    }
+
+    bool isAnyPacsFirstStep(Tile* tile, const Pacman& pac) {
+        return reservationsOf(pac).at(tile, 1) & ~ReservationTable::bitOf(pac);
+    }
+
+    /// True if a teammate that planned before pac will be on the tile at the given turn (speed taken into account).
+    bool reservedByTeammate(Tile* tile, int turn, const Pacman& pac) {
+        return reservationsOf(pac).at(tile, turn) & ~ReservationTable::bitOf(pac);
+    }
+
+    /// Where the per-pac planning logs go: cerr, or the pac's own buffer while pacs plan in parallel.
+    static ostream& log() {
+        return *planLog;
+    }
+
     void step() {
+        // What the search builds in this step lives in the arena, and is all freed at the start of the next one.
+        searchArena.reset();
+        SearchArena::Scope arenaScope(searchArena);
+#ifdef PACMAN_COUNT_ALLOCS
+        size_t heapAllocationsBefore = heapAllocations;
+#endif
+        cerr << "StateHash: pellets " << hex << board.pelletHash << " pacs " << pacHash << dec << endl;
+
         stringstream cmd;
         PacDestinationT myPacDestinations;
         PacDestinationT theirPacDestinations;
 
+        // Calculate distance to all tiles from each Pacman:
+        floodFillFromPacmansAndCache();
+
         // Estimate Opponent Destinations:
+        predictTheirRoutes();
         estimateTheirDestinations(theirPacDestinations);
         cerr << "OppDests: ";
         printPacDestinations(theirPacDestinations);
 
-        // Calculate distance to all tiles from each Pacman:
-        floodFillFromPacmansAndCache();
+        updateDangerMap();
+
+        planEndgame();
+        assignClusters();
+
+        // Clear all Pac Routes, keeping what is left of the old ones to warm-start from:
+        reservations[true].reset(board.numTiles());
+        for (auto& [id, pac] : myPacs) {
+            pac.prevRoute = routeAheadOf(pac, pac.route);
+            pac.route = Route();
+        }
+
+        auto planStart = chrono::steady_clock::now();
+        vector<optional<string>> commands;
+        switch (myPacs.size() > 1 ? planMode : PlanMode::sequential) {
+        case PlanMode::joint:
+            commands = planPacsJointly(myPacDestinations);
+            break;
+#ifdef PACMAN_THREADS
+        case PlanMode::parallel:
+            commands = planPacsInParallel(myPacDestinations);
+            break;
+#endif
+        default:
+            for (auto& [id, pac] : myPacs) {
+                commands.push_back(planPac(pac, myPacDestinations));
+            }
+        }
+        for (auto& command : commands) {
+            if (command) addCmd(cmd, *command);
+        }
+        auto planUs = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - planStart).count();
+        cerr << "Planned " << myPacs.size() << " pacs in " << planUs << "us" << endl;
+
+        // Output the final command:
+        // cerr << cmd.str() << endl; cerr.flush();
+        cout << cmd.str() << endl;
+#ifdef PACMAN_COUNT_ALLOCS
+        cerr << "HeapAllocs: " << heapAllocations - heapAllocationsBefore << endl;
+#endif
+
+        gameSteps++;
+    }
+
+
+    /// The command for one of my pacs: a fight if there is one, else a switch, a speed up or a move.
+    optional<string> planPac(Pacman& pac, PacDestinationT& myPacDestinations) {
+        log() << "Pac" << pac.pacId << ". Pos: " << pac.pos->x << "," << pac.pos->y << " STL: " << pac.speedTurnsLeft << " AC: " << pac.abilityCooldown << endl;
+
+        auto abilityCommand = planAbilities(pac, myPacDestinations);
+        if (abilityCommand) {
+            return abilityCommand;
+        }
+        return step_move(pac, myPacDestinations);
+    }
+
+    /// A fight, SWITCH or SPEED for pac, when one is called for. Else pac moves.
+    optional<string> planAbilities(Pacman& pac, PacDestinationT& myPacDestinations) {
+        auto combatCommand = step_combat(pac, myPacDestinations);
+        if (combatCommand) {
+            return combatCommand;
+        }
+
+        auto switchCommand = step_switch(pac);
+        if (switchCommand) {
+            return switchCommand;
+        }
+        auto speedCommand = step_speedUp(pac);
+        if (speedCommand) {
+            return speedCommand;
+        }
+        return nullopt;
+    }
+
+    /// Plans my pacs together: each one that moves gets its candidate routes scored against the best candidates of the
+    /// ones before it, so that pellets they share count half, but not kept off their tiles or pellets. A ConflictSearch
+    /// then picks the best set of candidates that do not collide. When that runs out of budget, the pacs follow their
+    /// best candidates, and a pac whose best collides with an earlier pac's plans again, as in planPacsInParallel.
+    vector<optional<string>> planPacsJointly(PacDestinationT& myPacDestinations) {
+        vector<Pacman*> pacs;
+        for (auto& [id, pac] : myPacs) pacs.push_back(&pac);
+        vector<optional<string>> commands(pacs.size());
+
+        vector<int> movers;     // Indices into pacs.
+        pmr::vector<pmr::vector<Route>> candidates(SearchArena::resource());
+        for (int i = 0; i < int(pacs.size()); i++) {
+            Pacman& pac = *pacs[i];
+            log() << "Pac" << pac.pacId << ". Pos: " << pac.pos->x << "," << pac.pos->y << " STL: " << pac.speedTurnsLeft << " AC: " << pac.abilityCooldown << endl;
+            commands[i] = planAbilities(pac, myPacDestinations);
+            if (!commands[i]) {
+                movers.push_back(i);
+                candidates.push_back(searchRoutes(pac));
+                if (!candidates.back().empty()) pac.route = candidates.back()[0];   // Unreserved, until the search picks.
+            }
+        }
+        for (int i : movers) pacs[i]->route = Route();
+        if (movers.empty()) return commands;
+
+        vector<const Pacman*> moverPacs;
+        vector<const pmr::vector<Route>*> moverCandidates;
+        for (int k = 0; k < int(movers.size()); k++) {
+            moverPacs.push_back(pacs[movers[k]]);
+            moverCandidates.push_back(&candidates[k]);
+        }
+        ConflictSearch search;
+        search.window = conflictWindowTurns;
+        auto searchStart = chrono::steady_clock::now();
+        optional<vector<int>> choice = search.solve(moverPacs, moverCandidates, conflictSearchMaxNodes,
+                                                    searchStart + chrono::microseconds(conflictSearchBudgetUs));
+        auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - searchStart).count();
+        cerr << "ConflictSearch: " << movers.size() << " pacs, nodes " << search.nodes << " conflicts " << search.conflicts
+             << " " << elapsed << "us" << (choice ? "" : ", out of budget: following the best candidates") << endl;
+
+        for (int k = 0; k < int(movers.size()); k++) {
+            Pacman& pac = *pacs[movers[k]];
+            int c = choice ? (*choice)[k] : candidates[k].empty() ? -1 : 0;
+            if (!choice && c != -1 && collidesWithTeammates(pac, candidates[k][c])) {
+                log() << " Replanning Pac" << pac.pacId << ": its best candidate collides with a teammate" << endl;
+                commands[movers[k]] = step_move(pac, myPacDestinations);
+                continue;
+            }
+            commands[movers[k]] = followRoute(pac, c == -1 ? nullptr : &candidates[k][c], myPacDestinations);
+        }
+        return commands;
+    }
 
-        // Clear all Pac Routes:
-        for (auto& [id, pac] : myPacs) {
-            pac.route = Route();
+#ifdef PACMAN_THREADS
+    /// Runs fn with the arena of this thread as SearchArena::resource(). The arena is reset only by the outermost
+    /// call on a thread: a task waiting for a nested loop runs tasks of that loop on top of what it was doing.
+    void onThreadArena(const function<void()>& fn) {
+        static thread_local SearchArena threadArena(32 << 20);
+        static thread_local int depth = 0;
+        if (depth++ == 0) threadArena.reset();
+        {
+            SearchArena::Scope arenaScope(threadArena);
+            fn();
+        }
+        depth--;
+    }
+
+    /// Every pac plans on its own thread, against the routes its teammates had last step, into its own destinations
+    /// and log. Then, in pac order, a pac whose claimed pellet or destination was already taken by an earlier one
+    /// plans again, this time seeing the routes the earlier ones just chose, as when they plan one after the other.
+    /// Kept as a build option for self-play: the game gives a bot one core, and it was not timed on more.
+    vector<optional<string>> planPacsInParallel(PacDestinationT& myPacDestinations) {
+        vector<Pacman*> pacs;
+        for (auto& [id, pac] : myPacs) pacs.push_back(&pac);
+        int n = pacs.size();
+        vector<optional<string>> commands(n);
+        vector<PacDestinationT> destinations(n);
+        vector<stringstream> logs(n);
+
+        for (Pacman* pac : pacs) reservations[true].reserve(*pac, pac->prevRoute);
+        planningOnSnapshot = true;
+        pool->parallelFor(n, [&](int i) {
+            onThreadArena([&] {
+                logs[i].precision(cerr.precision());
+                ostream* previousLog = planLog;
+                planLog = &logs[i];
+                commands[i] = planPac(*pacs[i], destinations[i]);
+                planLog = previousLog;
+            });
+        });
+        planningOnSnapshot = false;
+        reservations[true].reset(board.numTiles());
+        vector<Route> planned(n);
+        for (int i = 0; i < n; i++) {   // Each is taken back in turn below.
+            planned[i] = pacs[i]->route;
+            pacs[i]->route = Route();
         }
 
-        for (auto& [id, pac] : myPacs) {
-            cerr << "Pac" << id << ". Pos: " << pac.pos->x << "," << pac.pos->y << " STL: " << pac.speedTurnsLeft << " AC: " << pac.abilityCooldown << endl;
+        set<Tile*> claimed;
+        for (int i = 0; i < n; i++) {
+            Pacman& pac = *pacs[i];
+            cerr << logs[i].str();
 
-            auto switchCommand = step_switch(pac);
-            if (switchCommand) {
-                addCmd(cmd, *switchCommand);
+            bool conflict = pac.getClaimedTile() && claimed.count(pac.getClaimedTile());
+            for (auto& [tile, _] : destinations[i]) {
+                conflict = conflict || myPacDestinations.count(tile);
+            }
+            if (conflict) {
+                cerr << " Replanning Pac" << pac.pacId << ": its pellet or destination was taken" << endl;
+                commands[i] = planPac(pac, myPacDestinations);
             }
             else {
-                auto speedCommand = step_speedUp(pac);
-                if (speedCommand) {
-                    addCmd(cmd, *speedCommand);
-                }
-                else {
-                    auto moveCommand = step_move(pac, myPacDestinations, theirPacDestinations);
-                    if (moveCommand) {
-                        addCmd(cmd, *moveCommand);
-                    }
-                }
+                commitRoute(pac, planned[i]);
+                myPacDestinations.insert(destinations[i].begin(), destinations[i].end());
             }
+            if (pac.getClaimedTile()) claimed.insert(pac.getClaimedTile());
+        }
+        return commands;
+    }
+#endif
+
+    /// If visible enemies are within combatRadius, solve the fight and return the command for myPac.
+    /// The move of the route planner is kept when it is as good as the best action of the fight.
+    optional<string> step_combat(Pacman& myPac, PacDestinationT& myPacDestinations) {
+        using DistT = pair<int, Pacman*>;
+        vector<DistT> close;
+        for (auto& [id, theirPac] : theirPacs) {
+            if (!theirPac.visible) continue;
+            int dist = board.distance(myPac.pos, theirPac.pos);
+            if (dist <= combatRadius) close.push_back({dist, &theirPac});
+        }
+        if (close.empty()) return nullopt;
+        sort(close.begin(), close.end());
+        if (close.size() > CombatSolver::maxPacs - 1) close.resize(CombatSolver::maxPacs - 1);
+
+        CombatSolver::State root;
+        auto addPac = [&root](const Pacman& pac) {
+            CombatSolver::PacState& state = root.pacs[root.numPacs++];
+            state.tile = pac.pos->id;
+            state.type = typeIndex(pac.typeId);
+            state.speed = pac.speedTurnsLeft;
+            state.cooldown = pac.abilityCooldown;
+        };
+        addPac(myPac);
+        for (auto& [dist, theirPac] : close) addPac(*theirPac);
+
+        CombatSolver solver(board);
+        auto startTime = chrono::steady_clock::now();
+        auto values = solver.solve(root, combatMaxDepth, startTime + chrono::microseconds(combatTimeBudgetUs));
+        auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - startTime).count();
+        if (values.empty()) return nullopt;     // Not even depth 1 in time.
+
+        auto best = max_element(values.begin(), values.end(), [](auto& a, auto& b) { return a.value < b.value; });
+        log() << " Combat vs " << close.size() << " pacs: depth " << solver.depthReached << " nodes " << solver.nodes << " " << elapsed << "us best " << best->value << endl;
+
+        auto valueOfAction = [&values](auto matches) {
+            double value = -1e9;
+            for (auto& v : values) if (matches(v.action)) value = max(value, v.value);
+            return value;
+        };
+
+        // Abilities: keep speeding up whenever the fight allows it, as step_speedUp would.
+        double speedValue = valueOfAction([](auto& a) { return a.kind == CombatSolver::Action::SPEED; });
+        if (myPac.speedTurnsLeft == 0 && speedValue >= best->value) {
+            stringstream cmd;
+            cmd << "SPEED " << myPac.pacId;
+            return cmd.str();
         }
 
-        // Output the final command:
-        // cerr << cmd.str() << endl; cerr.flush();
-        cout << cmd.str() << endl;
+        auto moveCommand = step_move(myPac, myPacDestinations);
+        Tile* firstStep = myPac.route.firstStep();
+        Tile* secondStep = myPac.isSpeedActive() ? myPac.route.secondStep() : nullptr;
+        double plannedValue = valueOfAction([&](auto& a) {
+            return a.kind == CombatSolver::Action::MOVE && firstStep && a.steps[0] == firstStep->id
+                && a.steps[1] == (secondStep ? secondStep->id : -1);
+        });
+        if (moveCommand && plannedValue >= best->value) {
+            return moveCommand;
+        }
 
-        gameSteps++;
-    }
+        // The fight overrides the move: what teammates see of myPac is where the fight takes it instead.
+        Tile* plannedDest = secondStep ? secondStep : firstStep;
+        auto planned = plannedDest ? myPacDestinations.find(plannedDest) : myPacDestinations.end();
+        if (planned != myPacDestinations.end() && planned->second == &myPac) myPacDestinations.erase(planned);
+        withdrawRoute(myPac);
+        Route fightRoute;
+        const CombatSolver::Action& action = best->action;
+        for (int step : action.steps) {
+            if (action.kind == CombatSolver::Action::MOVE && step != -1) fightRoute.fullPath.push_back(board.tileById[step]);
+        }
+        if (fightRoute.fullPath.empty()) fightRoute.fullPath.push_back(myPac.pos);  // Stays for the turn.
+        commitRoute(myPac, fightRoute);
 
+        stringstream cmd;
+        if (action.kind == CombatSolver::Action::SWITCH) {
+            log() << " Switching Pac" << myPac.pacId << " to " << typeNames[action.switchType] << endl;
+            cmd << "SWITCH " << myPac.pacId << " " << typeNames[action.switchType];
+        }
+        else if (action.kind == CombatSolver::Action::SPEED) {
+            cmd << "SPEED " << myPac.pacId;
+        }
+        else {
+            int destId = action.steps[1] != -1 ? action.steps[1] : action.steps[0];
+            Tile* dest = destId != -1 ? board.tileById[destId] : myPac.pos;
+            myPacDestinations[dest] = &myPac;
+            cmd << "MOVE " << myPac.pacId << " " << dest->x << " " << dest->y << " fight";
+        }
+        return cmd.str();
+    }
 
     optional<string> step_switch(Pacman& myPac) {
         //cerr << " Step switch check for Pac" << myPac.pacId << endl;
@@ -685,7 +2938,7 @@ public:
             priority_queue<DistT, vector<DistT>, std::greater<DistT>> distances;
 
             for (auto& [theirId, theirPac] : theirVisiblePacs) {
-                int dist = myPac.distanceToTile[theirPac.pos];
+                int dist = myPac.distanceToTile[theirPac.pos->id];
                 distances.push({dist, &theirPac});
                 // cerr << "  Dist to theirPac" << theirPac.pacId << ": "<< dist << endl;
             }
@@ -697,7 +2950,7 @@ public:
                 string toType = typeStrongAgainst.at(theirPac->typeId);
 
                 if (myPac.typeId != toType) {
-                    cerr << " Switching Pac" << myPac.pacId << " to " << toType << endl;
+                    log() << " Switching Pac" << myPac.pacId << " to " << toType << endl;
                     stringstream cmd;
                     cmd << "SWITCH " << myPac.pacId << " " << toType; // SWITCH pacId pacType
                     return cmd.str();
@@ -721,7 +2974,7 @@ public:
             priority_queue<DistT, vector<DistT>, std::greater<DistT>> distances;
 
             for (auto& [theirId, theirPac] : theirVisiblePacs) {
-                int dist = myPac.distanceToTile[theirPac.pos];
+                int dist = myPac.distanceToTile[theirPac.pos->id];
                 distances.push({dist, &theirPac});
                 // cerr << "  Dist to theirPac" << theirPac.pacId << ": "<< dist << endl;
             }
@@ -739,14 +2992,14 @@ public:
 
                     if (typeStrongAgainst.at(myPac.typeId) == closestPac->typeId) {
                         // Don't speed up.
-                        cerr << " Skip speedup coz oppPac " << closestPac->pacId << " is close." << endl;
+                        log() << " Skip speedup coz oppPac " << closestPac->pacId << " is close." << endl;
                         return nullopt;
                     }
                 }
             }
 
             // Else we are safe to speed up:
-            cerr << " Speeding Pac" << myPac.pacId << endl;
+            log() << " Speeding Pac" << myPac.pacId << endl;
             stringstream cmd;
             cmd << "SPEED " << myPac.pacId; // SPEED pacId
             return cmd.str();
@@ -757,17 +3010,31 @@ public:
     }
 
 
-    optional<string> step_move(Pacman& mypac, PacDestinationT& myPacDestinations, PacDestinationT& theirPacDestinations) {
+    optional<string> step_move(Pacman& mypac, PacDestinationT& myPacDestinations) {
+        pmr::vector<Route> routes = searchRoutes(mypac);
+        return followRoute(mypac, routes.empty() ? nullptr : &routes[0], myPacDestinations);
+    }
+
+    /// The best routes for mypac given what its teammates planned so far, best first.
+    pmr::vector<Route> searchRoutes(Pacman& mypac) {
         //cerr << " Step Move check for Pac" << mypac.pacId << endl; cerr.flush();
 
         ///------ New Logic: ----///
-        int N = 20;  // Total length of path to have.
+        int N = 20;  // Turns to plan for. While sped up, the first ones cover two tiles each.
 
         // 0. Reset / Clear previous route and other things:
         // QUESTION: Should I clear one by one for each pac, or should they be all cleared at once outside this?
 
         // 1. Get path to closest pellet that is not beyond boundary and is not claimed by other mypacs.
-        vector<Path> paths = pathsToClosestPellets(mypac, theirPacDestinations);
+        // In the endgame, follow the solved tour instead.
+        optional<Route> endgameRoute = endgameRouteFor(mypac, N);
+        // The cluster filter below may drop any of the targets, so the search can only stop early without it.
+        int maxTargets = clusterTargets.count(mypac.pacId) ? 0 : maxFrontierTargets;
+        Frontier frontier = endgameRoute ? Frontier() : closestPelletsFrontier(mypac, maxTargets);
+        pmr::vector<int>& targets = frontier.targets;
+        keepTargetsTowardCluster(mypac, targets);
+        int numFrontier = targets.size();
+        if (maxFrontierTargets > 0 && numFrontier > maxFrontierTargets) targets.resize(maxFrontierTargets);
         //cerr << " Ran pathsToClosestVisiblePellets. paths.size:" << paths.size() << endl;
 
         // 2. Also get path to closestPotentialPellet. (TODO)
@@ -777,17 +3044,49 @@ public:
         // 4. Extend each path upto N (or until deadend) if not already >= N. (Convert Path into Route. Route contains more information.)
         // 5. Evaluate each routes's total rewards - this is where we'll give incentive to kill or flee if opponent is next to us. Can also make potential pellet values probabilistic.
         //cerr << " ";
-        vector<Route> routes;
-        for (auto& path : paths) {
-            vector<Route> routesForThisPath = extendPathIntoRouteOfN(path, N, mypac);
+        // Last step's route, if still valid, is the incumbent: only routes that can beat it are searched further.
+        // A stale one means the board changed under it, so the search runs in full.
+        optional<Route> warmRoute = endgameRoute ? nullopt : warmStartRoute(mypac, N);
+        SearchLimits limits;
+        if (warmRoute) {
+            // Against its value after the teammate rescoring: that only takes reward off, so a route pruned against
+            // it could not have won after the rescoring either.
+            pmr::vector<Route> warm(1, *warmRoute, SearchArena::resource());
+            rescoreForTeammateRoutes(mypac, warm);
+            limits.pruneBelow = warm[0].totalReward;
+        }
+        limits.table = &routeTable;     // Rewards depend on the pac, so it starts empty for each.
+        limits.generation = routeTable.newGeneration();
+
+        TopRoutes topRoutes(routeCandidates);
+        auto searchStart = chrono::steady_clock::now();
+#ifdef PACMAN_THREADS
+        if (targets.size() > 1) {
+            searchPathsInParallel(frontier, N, mypac, limits, topRoutes);
+        }
+        else
+#endif
+        for (int i = 0; i < int(targets.size()); i++) {
+            limits.maxNodes = max(1, nodesForFirstOf(int(targets.size()) - i, planNodeBudget - limits.nodesExpanded));
+            extendPathIntoRouteOfN(pathTo(frontier, targets[i]), N, mypac, limits, topRoutes);
             // cerr << "R:"; cerr.flush();
             // for_each(routesForThisPath.begin(), routesForThisPath.end(), [this, &mypac](Route& rt) {
             //     calculateRouteReward3(rt, mypac);
             // });
 
             // cerr << route.totalReward << " ";cerr.flush();
-            routes.insert(routes.end(), routesForThisPath.begin(), routesForThisPath.end());
         }
+        auto searchUs = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - searchStart).count();
+        if (endgameRoute) {
+            topRoutes.offer(move(*endgameRoute));
+        }
+        if (warmRoute) {
+            topRoutes.offer(move(*warmRoute));
+        }
+        int numRoutes = topRoutes.numOffered();
+        pair<double, double> rewardRange(topRoutes.bestOffered(), topRoutes.worstOffered());
+        pmr::vector<Route> routes = topRoutes.takeSorted();
+        rescoreForTeammateRoutes(mypac, routes);
                 // cerr << "R:"; cerr.flush();
         // for_each(routesForThisPath.begin(), routesForThisPath.end(), [this, &mypac](Route& rt) {
         //     calculateRouteReward3(rt, mypac);
@@ -822,27 +3121,38 @@ public:
         // }
 
         // 6. Pick the best of these routes, and set that as the final route for this pac.
+        // Only the best routeCandidates are left by now, so this sort is cheap.
         sort(routes.begin(), routes.end(), [](const Route& rt1, const Route& rt2) {
             return rt1.totalReward > rt2.totalReward;
         });
-        // pair<double, double> rewardRange = (routes.empty())? {0.0, 0.0} : {routes.front().totalReward, routes.back().totalReward}; // This syntax doesnt work :(
-        pair<double, double> rewardRange = (routes.empty())? pair<double, double>(0.0, 0.0) : pair<double, double>(routes.front().totalReward, routes.back().totalReward);
-
-        cerr << " pathsToClosestPellets: " << paths.size() << " Total Routes: " << routes.size() << " RewardRange: [" << rewardRange.first << ", " << rewardRange.second << "]" << endl;
 
+        log() << " Frontier: " << targets.size() << "/" << numFrontier << " Total Routes: " << numRoutes << " RewardRange: [" << rewardRange.first << ", " << rewardRange.second << "]"
+             << " WarmStart: " << (limits.pruneBelow > -1e9 ? "yes" : "stale") << " Nodes: " << limits.nodesExpanded << " Pruned: " << limits.nodesPruned
+             << " TableHits: " << limits.tableHits << "/" << limits.tableProbes
+             << " " << searchUs << "us (" << limits.nodesExpanded / max<double>(searchUs, 1) << " nodes/us)" << endl;
+        return routes;
+    }
 
-        if (routes.empty()) {
+    /// Sets route as mypac's route and moves along it. Without a route, mypac heads for a teammate's pellet or flees.
+    optional<string> followRoute(Pacman& mypac, const Route* route, PacDestinationT& myPacDestinations) {
+        if (!route) {
             // This can happen when there are more Pacs than pellets remaining towards the end.
             // For now just choose the first Pac's claimed pellet.
             Tile* pelletTile = nullptr;
             for(auto& [otherId, otherPac] : myPacs) {
-                pelletTile = otherPac.getClaimedTile();
+                pelletTile = plannedRouteOf(otherPac, mypac).firstPelletTile;
                 if(pelletTile) {
-                    cerr << " Moving to otherPac" << otherId << "'s destination" << " {[" << pelletTile->x << "," << pelletTile->y <<  "]} " << endl;
+                    log() << " Moving to otherPac" << otherId << "'s destination" << " {[" << pelletTile->x << "," << pelletTile->y <<  "]} " << endl;
                     break;
                 }
             }
 
+            // Or it can happen because enemies have cut off every pellet. Then just get away from them.
+            if (!pelletTile || !danger.isSafe(typeIndex(mypac.typeId), mypac.pos, 1)) {
+                pelletTile = safestStepFor(mypac);
+                log() << " Fleeing to" << " {[" << pelletTile->x << "," << pelletTile->y <<  "]} " << endl;
+            }
+
             stringstream cmd;
             cmd << "MOVE " << mypac.pacId << " " << pelletTile->x << " " << pelletTile->y;
             cmd << " {[" << pelletTile->x << "," << pelletTile->y <<  "]} ";
@@ -851,11 +3161,11 @@ public:
             // TODO: Make this ^ better by creating path & route and then storing the route on pac.
         }
 
-        if (!routes.empty()) {
+        if (route) {
             // Set this as the final Route
-            mypac.route = routes[0];
-            cerr << " " << mypac.routeToStr() << endl;
-            cerr.flush();
+            commitRoute(mypac, *route);
+            log() << " " << mypac.routeToStr() << endl;
+            log().flush();
 
             // Move to first tile in route:
             Tile* pelletTile = mypac.getClaimedTile();
@@ -876,37 +3186,266 @@ public:
             return cmd.str();
         }
         else {
-            cerr << " Couldn't determine destination for Pac: " << mypac.pacId << endl;
+            log() << " Couldn't determine destination for Pac: " << mypac.pacId << endl;
             return nullopt;
         }
 
     }
 
 
-    /// Route to closest pellet (visible or not) by BFS on the graph.
+    /// Exact multi-pac clean-up once few pellets are left: for every pac and every subset of the remaining pellets,
+    /// the shortest walk from the pac through all of them (Held-Karp over the distance table); then the split of the pellets
+    /// between pacs that minimizes the time until all are eaten, and then the total walking.
+    void planEndgame() {
+        endgameTours.clear();
+
+        vector<Tile*> pellets;
+        double expected = 0;
+        for (Tile* tile : board.tileById) {
+            double survival = tile->pelletValue > 0 ? 1.0 : tile->pelletValue == 0 ? 0.0 : board.pelletSurvival[tile->id];
+            expected += survival;
+            if (survival >= endgameMinSurvival) {
+                pellets.push_back(tile);
+            }
+        }
+        if (myPacs.empty() || pellets.empty() || expected > endgamePelletThreshold || int(pellets.size()) > endgamePelletThreshold) {
+            return;
+        }
+        auto startTime = chrono::steady_clock::now();
+
+        int n = pellets.size();
+        int full = (1 << n) - 1;
+        const int inf = 1e8;
+
+        // cost[p][S]: shortest walk for pac p through all pellets of S. last[p][S * n + i]: dp state, parent[p][...]: previous pellet.
+        vector<Pacman*> pacs;
+        for (auto& [id, pac] : myPacs) pacs.push_back(&pac);
+        int k = pacs.size();
+        vector<vector<int>> cost(k, vector<int>(full + 1, inf));
+        vector<vector<int>> walk(k, vector<int>((full + 1) * n, inf));
+        vector<vector<int8_t>> parent(k, vector<int8_t>((full + 1) * n, -1));
+
+        for (int p = 0; p < k; p++) {
+            vector<int>& dp = walk[p];
+            cost[p][0] = 0;
+            for (int i = 0; i < n; i++) {
+                dp[(1 << i) * n + i] = board.distance(pacs[p]->pos, pellets[i]);
+            }
+            for (int S = 1; S <= full; S++) {
+                for (int i = 0; i < n; i++) {
+                    int curr = dp[S * n + i];
+                    if (!(S >> i & 1) || curr >= inf) continue;
+                    cost[p][S] = min(cost[p][S], curr);
+                    for (int j = 0; j < n; j++) {
+                        if (S >> j & 1) continue;
+                        int T = S | (1 << j);
+                        int next = curr + board.distance(pellets[i], pellets[j]);
+                        if (next < dp[T * n + j]) {
+                            dp[T * n + j] = next;
+                            parent[p][T * n + j] = i;
+                        }
+                    }
+                }
+            }
+        }
+
+        // best[p][S]: (time until all of S is eaten, total walking) using pacs 0..p. choice[p][S]: the subset of S given to pac p.
+        using ScoreT = pair<int, int>;
+        vector<vector<ScoreT>> best(k, vector<ScoreT>(full + 1));
+        vector<vector<int>> choice(k, vector<int>(full + 1, 0));
+        for (int S = 0; S <= full; S++) {
+            best[0][S] = {cost[0][S], cost[0][S]};
+            choice[0][S] = S;
+        }
+        for (int p = 1; p < k; p++) {
+            for (int S = 0; S <= full; S++) {
+                ScoreT bestScore = {inf, inf};
+                for (int T = S; ; T = (T - 1) & S) {     // All subsets T of S, for pac p.
+                    const ScoreT& rest = best[p - 1][S ^ T];
+                    ScoreT score = {max(rest.first, cost[p][T]), rest.second + cost[p][T]};
+                    if (score < bestScore) {
+                        bestScore = score;
+                        choice[p][S] = T;
+                    }
+                    if (T == 0) break;
+                }
+                best[p][S] = bestScore;
+            }
+        }
+
+        int S = full;
+        for (int p = k - 1; p >= 0; p--) {
+            int T = choice[p][S];
+            S ^= T;
+            vector<Tile*>& tour = endgameTours[pacs[p]->pacId];
+            if (T == 0) continue;
+
+            int last = -1;
+            for (int i = 0; i < n; i++) {
+                if ((T >> i & 1) && (last == -1 || walk[p][T * n + i] < walk[p][T * n + last])) last = i;
+            }
+            for (int U = T; last != -1; ) {
+                tour.push_back(pellets[last]);
+                int prev = parent[p][U * n + last];
+                U ^= 1 << last;
+                last = prev;
+            }
+            reverse(tour.begin(), tour.end());
+        }
+
+        auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - startTime).count();
+        cerr << "Endgame: " << n << " pellets, " << k << " pacs, all eaten in " << best[k - 1][full].first << " steps. " << elapsed << "us" << endl;
+    }
+
+    /// Region-level plan: each pac heads for a pellet cluster, picked greedily by mass over distance. Pacs heading
+    /// for the same cluster share its mass, so a big one can take several and small ones are left to the closest.
+    /// Not used in the endgame, whose tours already split the pellets.
+    void assignClusters() {
+        clusters.update(board);
+        clusterTargets.clear();
+        if (!clusterPlanning || !endgameTours.empty() || clusters.roots().empty()) return;
+
+        map<int, vector<int>> closest;  // pacId -> [root] distance to the cluster's closest tile, INT_MAX if out of reach.
+        for (auto& [id, pac] : myPacs) {
+            vector<int>& dist = closest[id];
+            dist.assign(board.numTiles(), INT_MAX);
+            for (int tile = 0; tile < board.numTiles(); tile++) {
+                int root = clusters.clusterOf(tile);
+                if (root >= 0 && pac.distanceToTile[tile] >= 0) dist[root] = min(dist[root], pac.distanceToTile[tile]);
+            }
+        }
+        vector<int> heading(board.numTiles(), 0);   // [root]
+        while (clusterTargets.size() < myPacs.size()) {
+            double bestValue = -1;
+            int bestPac = -1, bestRoot = -1;
+            for (auto& [id, dist] : closest) {
+                if (clusterTargets.count(id)) continue;
+                for (int root : clusters.roots()) {
+                    if (dist[root] == INT_MAX) continue;
+                    double value = clusters.mass(root) / (1 + heading[root]) / (1.0 + dist[root]);
+                    if (value > bestValue) {
+                        bestValue = value;
+                        bestPac = id;
+                        bestRoot = root;
+                    }
+                }
+            }
+            if (bestPac == -1) break;
+            clusterTargets[bestPac] = bestRoot;
+            heading[bestRoot]++;
+        }
+
+        cerr << "Clusters: " << clusters.roots().size() << ". Targets:";
+        for (auto& [id, root] : clusterTargets) {
+            Tile* tile = board.tileById[root];
+            cerr << " Pac" << id << "->(" << tile->x << "," << tile->y << ") " << clusters.size(root) << " tiles " << clusters.mass(root);
+        }
+        cerr << endl;
+    }
+
+    /// Drops the frontier targets in a cluster another pac heads for, unless that is all there is.
+    /// Targets in mypac's own cluster and in clusters no one heads for are kept.
+    void keepTargetsTowardCluster(Pacman& mypac, pmr::vector<int>& targets) {
+        auto target = clusterTargets.find(mypac.pacId);
+        if (target == clusterTargets.end()) return;
+        set<int> othersTargets;
+        for (auto& [id, root] : clusterTargets) {
+            if (root != target->second) othersTargets.insert(root);
+        }
+        auto intoOthers = [&](int tile) { return othersTargets.count(clusters.clusterOf(tile)) > 0; };
+        if (!all_of(targets.begin(), targets.end(), intoOthers)) {
+            targets.erase(remove_if(targets.begin(), targets.end(), intoOthers), targets.end());
+        }
+    }
+
+    /// Route along mypac's endgame tour, unless it's not in the endgame or the first steps are not safe.
+    optional<Route> endgameRouteFor(Pacman& mypac, int N) {
+        auto tour = endgameTours.find(mypac.pacId);
+        if (tour == endgameTours.end() || tour->second.empty()) return nullopt;
+
+        int myType = typeIndex(mypac.typeId);
+        Route route;
+        route.firstPelletTile = tour->second.front();
+        route.horizon = N;
+        Tile* curr = mypac.pos;
+        for (Tile* target : tour->second) {
+            while (curr != target && route.fullPath.size() < N) {
+                // Step to a neighbour closer to the target; prefer one with a pellet on it.
+                Tile* next = nullptr;
+                for (Tile* neighbour : curr->neighbours) {
+                    if (board.distance(neighbour, target) != board.distance(curr, target) - 1) continue;
+                    if (!next || neighbour->getPelletValueAdjusted() > next->getPelletValueAdjusted()) next = neighbour;
+                }
+                curr = next;
+                route.fullPath.push_back(curr);
+            }
+        }
+        for (int i = 0; i < min<int>(2, route.fullPath.size()); i++) {
+            if (!danger.isSafe(myType, route.fullPath[i], turnsToReach(mypac, i + 1))) return nullopt;
+        }
+        if (route.empty()) return nullopt;
+        return route;
+    }
+
+    /// What the frontier BFS found: the tree it grew, as parent pointers, and the frontier tiles, best first.
+    /// Paths to the targets share their prefixes in the tree, so they are only built (by pathTo) for the targets
+    /// that get searched.
+    struct Frontier {
+        pmr::vector<int> parent{SearchArena::resource()};  // [tile id] -> id of the tile it was reached from. -1 for the source and unreached tiles.
+        pmr::vector<int> pathLength{SearchArena::resource()};  // [tile id] -> steps from the source. -1 if unreached.
+        pmr::vector<int> targets{SearchArena::resource()};     // Tile ids.
+    };
+
+    /// Tiles from the step after the source up to and including target.
+    Path pathTo(const Frontier& frontier, int target) {
+        Path path(frontier.pathLength[target], SearchArena::resource());
+        for (int id = target, i = path.size(); i > 0; id = frontier.parent[id]) {
+            path[--i] = board.tileById[id];
+        }
+        return path;
+    }
+
+    /// Closest pellets (visible or not) by BFS on the graph.
     /// If that pellet is claimed by other mypac, then choose another BUT IMP choose one that is on the boundary. (not beyond the first accessible pellet on any path).
     /// Goal Criteria: Pellet to this pac; my other pac on a tile is a blocking tile.
-    vector<Path> pathsToClosestPellets(Pacman& pac, PacDestinationT& theirPacDestinations) {
-        vector<Path> pathsToAllClosestPellets;
+    /// With maxTargets, stops once that many are found, after the rest of the ones as close as the last of them.
+    Frontier closestPelletsFrontier(Pacman& pac, int maxTargets = 0) {
+        Frontier frontier;
+        int n = board.numTiles();
+        frontier.parent.assign(n, -1);
+        frontier.pathLength.assign(n, -1);
+        pmr::vector<int>& pathLength = frontier.pathLength;
 
         Tile* source = pac.pos;
-        auto visibleTilesToThisPac = pac.getVisibleTiles();
-
-        queue<Tile*> q;
-        unordered_map<Tile*, Tile*> discoveredBy;    // aka visited + parent combined. <child, parent>
-        unordered_map<Tile*, int> pathLength;
+        int myType = typeIndex(pac.typeId);
 
+        queue<Tile*, pmr::deque<Tile*>> q(pmr::deque<Tile*>(SearchArena::resource()));
         q.push(source);
-        discoveredBy.emplace(source, nullptr);
-        pathLength.emplace(source, 0);
+        pathLength[source->id] = 0;
 
         while (!q.empty()) {
             Tile* currTile = q.front(); q.pop();
 
+            // Tiles come off the queue closest first, so no later one can rank above the targets found so far.
+            int numTargets = frontier.targets.size();
+            if (maxTargets > 0 && numTargets >= maxTargets && pathLength[currTile->id] > pathLength[frontier.targets[maxTargets - 1]]) {
+                break;
+            }
+
+            // Don't go to/beyond tiles where an enemy that can eat us may get to first.
+            if (pac.mine && currTile != source && !danger.isSafe(myType, currTile, turnsToReach(pac, pathLength[currTile->id]))) {
+                continue;
+            }
+
+            // Nor through a teammate, now or when it will be there.
+            if (currTile != source && reservedByTeammate(currTile, turnsToReach(pac, pathLength[currTile->id]), pac)) {
+                continue;
+            }
+
             if (currTile->pacOnTile) {
                 Pacman* otherPac = currTile->pacOnTile;
 
-                if (otherPac->mine) {
+                if (otherPac->mine == pac.mine) {
                      if (otherPac != &pac) {
                         // Don't go beyond this node if this tile has another Pac of mine on it. only if this tile is close to mypac.
                         //if (pathLength[currTile] <= 3) {
@@ -915,68 +3454,35 @@ public:
                      }                    
                 }
                 else {  // enemy pac
-                    
-                    if (pathLength[currTile] == 1 || pathLength[currTile] == 2) {
-
-                        if (typeWeakAgainst.at(otherPac->typeId) == pac.typeId) { // I'm weak against them. So dont go to/beyond this node.
-                            continue;
-                        }
-                        else if (typeStrongAgainst.at(otherPac->typeId) == pac.typeId) {
-                            // It's fine; we may eat them. nothing to do in this if-case.
-                            // Actually, no. They can transform in that turn and we'll be dead. It depends:
-                            if (otherPac->speedTurnsLeft == 0 && pathLength[currTile] == 1) {
-                                // We can definitely eat them right now
-                                // Include this path.   
-                            }
-                            else {
-                                // Even if we can eat them, they will probably get the pellets, so why bother?
-                                continue;
-                            }
-                        }
-                        else if (findValue(theirPacDestinations, otherPac)->first == source) {
-                            continue;   // Probable collision.
-                        }
-                        else {
-                            // Probably no collision; so it's probably fine. nothing to do in this if-case.
-                            // Actually Not fine, atleast in this case:
-                            // if (currTile->neighbours.size() == 2) {
-                                continue;
-                            // }
-                        }
-
-                        // If this is the first step, and if it is also the first step of any other mypacs, then drop this path.
-                        // NOTE: This also equally applicable whether this pac is sped up or other pacs is sped up or both.
-                        if (isAnyPacsFirstStep(currTile)) {
-                            continue;
-                        }
-                    }
-                    else if (pathLength[currTile] <= 5) {
+                    // The danger map already dropped the ones that can eat us. Go for the rest only if we can definitely eat them right now,
+                    // else they will probably get the pellets, so why bother?
+                    bool canEatNow = typeStrongAgainst.at(otherPac->typeId) == pac.typeId && otherPac->speedTurnsLeft == 0 && pathLength[currTile->id] == 1;
+                    if (!canEatNow) {
                         continue;
                     }
 
+                    // If this is the first step, and if it is also the first step of any other mypacs, then drop this path.
+                    // NOTE: This also equally applicable whether this pac is sped up or other pacs is sped up or both.
+                    if (isAnyPacsFirstStep(currTile, pac)) {
+                        continue;
+                    }
                 }
             }
 
 
 
             // GOAL:
-            if(currTile->getPelletValueAdjusted() > 0 && tileClaimedByPac(currTile) == nullptr) {
-                Path path;
-                while (currTile != source) {
-                    path.push_back(currTile);
-                    currTile = discoveredBy.at(currTile);
-                }
-                reverse(path.begin(), path.end());
-                pathsToAllClosestPellets.push_back(move(path));
+            if(currTile->getPelletValueAdjusted() > 0 && !tileClaimedByPac(currTile, pac)) {
+                frontier.targets.push_back(currTile->id);
             }
 
             // Only add neighbours of tiles without pellets. This ensures that we don't go beyond the boundary of first pellets.
             if (currTile->pelletValue == 0) {
 
                 for (Tile* neighbour : currTile->neighbours) {
-                    if (discoveredBy.count(neighbour)==0) {
-                        pathLength[neighbour] = pathLength.at(currTile) + 1;
-                        discoveredBy.emplace(neighbour, currTile);
+                    if (pathLength[neighbour->id] == -1) {
+                        pathLength[neighbour->id] = pathLength[currTile->id] + 1;
+                        frontier.parent[neighbour->id] = currTile->id;
                         q.push(neighbour);
                     }
                 }
@@ -984,164 +3490,547 @@ public:
 
         }
 
-        return pathsToAllClosestPellets;
+        // Closest first; of those as close, the ones with the most pellets around them.
+        if (!board.pelletMass.empty()) stable_sort(frontier.targets.begin(), frontier.targets.end(), [&](int a, int b) {
+            if (pathLength[a] != pathLength[b]) return pathLength[a] < pathLength[b];
+            return board.pelletMassWithin(board.tileById[a], Board::massRadius) > board.pelletMassWithin(board.tileById[b], Board::massRadius);
+        });
+        return frontier;
+    }
+
+
+    /// The rewardModifier of a route once it steps from prevTile onto currTile, the pathSize-th tile of its fullPath
+    /// (which starts at mypac.pos), given the one before.
+    double nextRewardModifier(double modifier, const Tile* prevTile, const Tile* currTile, int pathSize, const Pacman& mypac) const {
+        if (modifier != 1.0 && prevTile && prevTile->neighbours.size() > 2) {
+            modifier = 1.0;
+        }
+        const Pacman* otherPac = currTile->pacOnTile;
+        if (!otherPac || otherPac == &mypac || otherPac->mine == mypac.mine) return modifier;
+
+        if (currTile->neighbours.size() == 2) {
+            modifier = 0; // This means, 0 rewards beyond enemy pac,.. until we'll reset it when there are > 2 neighbours of currTile.
+        }
+        else if (currTile->neighbours.size() > 2) {
+            modifier = 0.5;
+        }
+        if (otherPac->speedTurnsLeft == 0 && pathSize == 2) {   // Next to us: step_combat settles that fight, not this route.
+            modifier = 1.0;
+        }
+        return modifier;
+    }
+
+    /// Reward, before discounting, for stepping onto the last tile of currRoute.fullPath (which starts at mypac.pos).
+    /// Also tracks the route's super pellets, enemies and reward modifier; stop is set when the route must end on this tile.
+    double stepReward(Route& currRoute, Pacman& mypac, bool& stop) {
+        TilePath& currPath = currRoute.fullPath;
+        int pathSize = currPath.size();
+        Tile* currTile = currPath.back();
+        Tile* prevTile = currPath[pathSize-2];
+        int myType = typeIndex(mypac.typeId);
+
+        double reward = 0.0;
+
+        /// Pellet Reward is gonna be:
+        //  (2*pelletValue - 1) discounted
+        // Problem with this reward calculation:
+        //  - It prefers longer routes of pellets over shorter routes,.. so when N is high like 20, it will deliberately take a longer path through a super pellet
+        //  - There is not enough reward for the close-ness of a super pellet on the path.
+        //  See https://www.codingame.com/share-replay/465045001
+        if (currTile->pelletValue == 10 && currRoute.hasSuperPellets()) {
+            reward = 0; //  To address above problem. Fixed: https://www.codingame.com/share-replay/465070869
+        }
+        else {
+            // If some other pacman has this SuperPellet on its route, then reduce reward for this.
+            bool otherPacGoingForIt = currTile->getPelletValueAdjusted() == 10
+                                      && (reservationsOf(mypac).passing(currTile) & ~ReservationTable::bitOf(mypac));
+            if (otherPacGoingForIt) reward = 0.5*currTile->getPelletValueAdjusted();
+            else reward = currTile->getPelletValueAdjusted();
+        }
+
+        ///
+        // if(i == 0 && tile->pacOnTile) {   // TODO: Think about this more.
+        //     reward += 10;   // Reward for kill.
+        // }
+
+        if (currTile->getPelletValueAdjusted() == 10) {
+            currRoute.superPellets.push_back(currTile);
+        }
+
+        currRoute.rewardModifier = nextRewardModifier(currRoute.rewardModifier, prevTile, currTile, pathSize, mypac);
+
+        /// Todo In exhaustive search,.. If a tile has pac on it, end path there if that tile has only 2 neighbours;
+        // regardless of whether it’s my other pac or enemy pac.
+        // If it has 3 neighbours then somehow half all subsequent rewards if enemy pac. If it’s my pac and it has decided a route already,
+        // check its next step and cut off path at its next step.
+        if (currTile->pacOnTile && currTile->pacOnTile != &mypac) {
+            Pacman* otherPac = currTile->pacOnTile;
+
+            if (otherPac->mine == mypac.mine) {
+                stop = true;
+            }
+            else {
+                auto& enemies = currRoute.enemyPacsOnRoute;
+                if (find(enemies.begin(), enemies.end(), otherPac) == enemies.end()) {    // It can be remembered on more than one tile.
+                    enemies.push_back(otherPac);
+                }
+            }
+
+        }
+
+        // Teammates that planned before us will be on this tile at the same time, or are coming the other way.
+        int turn = turnsToReach(mypac, pathSize-1);
+        if (reservedByTeammate(currTile, turn, mypac)
+            || reservationsOf(mypac).at(prevTile, turn) & reservationsOf(mypac).at(currTile, turn - 1) & ~ReservationTable::bitOf(mypac)) {
+            stop = true;
+        }
+
+        if (mypac.mine) {
+
+            // Don't go to/beyond tiles where an enemy that can eat us may get to first.
+            if (!danger.isSafe(myType, currTile, turn)) {
+                stop = true;
+            }
+
+            // An enemy of the same type predicted to be here at the same time would block us.
+            if (!enemyPlanTurn.empty() && enemyPlanTurn[currTile->id] == turn && enemyPlanType[currTile->id] == myType) {
+                stop = true;
+            }
+        }
+
+        return reward;
+    }
+
+    /// Budget and pruning threshold for one run of extendPathIntoRouteOfN, and what it did with them.
+    struct SearchLimits {
+        int maxNodes = INT_MAX;     // After this many nodes (turns: two tiles while sped up), routes are taken as they are.
+        double pruneBelow = -1e9;   // Routes that cannot get above this reward are dropped, e.g. when a warm start already has it.
+#ifdef PACMAN_THREADS
+        SharedTopRewards* sharedTop = nullptr;  // Rewards found so far by all of the searches running in parallel.
+#endif
+        TranspositionTable* table = nullptr;    // Shared by the searches of one pac, under one generation.
+        uint16_t generation = 0;
+        bool onlyBest = false;  // Only the best route is kept, so a state found in the table needs only its best way on.
+        int nodesExpanded = 0;
+        int nodesPruned = 0;
+        int tableProbes = 0;
+        int tableHits = 0;      // Probes that saved searching below the state.
+
+        double incumbent() const {
+#ifdef PACMAN_THREADS
+            if (sharedTop) return max(pruneBelow, sharedTop->kthBest());
+#endif
+            return pruneBelow;
+        }
+
+        bool hasIncumbent() const {
+#ifdef PACMAN_THREADS
+            if (sharedTop) return true;
+#endif
+            return pruneBelow > -1e9;
+        }
+    };
+
+    /// Largest reward a single non-super-pellet step can currently earn.
+    double maxRegularStepValue() {
+        double best = 0;
+        for (Tile* tile : board.tileById) {
+            if (tile->getPelletValueAdjusted() < 10) best = max(best, tile->getPelletValueAdjusted());
+        }
+        return best;
+    }
+
+    /// Route rewards are discounted per turn, not per tile: while a pac's speed lasts, a turn covers two tiles, which
+    /// are discounted alike. Also how many tiles the pac covers in the turns planned for.
+    struct TurnDiscounts {
+        int maxTiles;   // Tiles covered in the horizon's turns, but no more than a route being searched holds.
+        array<double, TilePath::capacity + 1> discount{};   // [k]: for the k-th tile after pac.pos.
+        array<double, TilePath::capacity + 2> remaining{};  // [k]: discount[k] + ... + discount[maxTiles].
+        array<bool, TilePath::capacity + 1> endsTurn{};     // [k]: the pac stops on the k-th tile at the end of a turn.
+    };
+
+    TurnDiscounts turnDiscountsFor(const Pacman& pac, int horizonTurns) {
+        TurnDiscounts turns;
+        turns.maxTiles = min(TilePath::capacity - 1, horizonTurns + min(horizonTurns, pac.speedTurnsLeft));
+        for (int k = 0; k <= TilePath::capacity; k++) {
+            int turn = turnsToReach(pac, k);
+            turns.discount[k] = RoutePolicy::discount(turn);
+            turns.endsTurn[k] = turnsToReach(pac, k + 1) > turn;
+        }
+        for (int k = turns.maxTiles; k >= 0; k--) {
+            turns.remaining[k] = turns.discount[k] + turns.remaining[k + 1];
+        }
+        return turns;
+    }
+
+    /// Upper bound on the discounted reward still to come after a route of pathSize tiles (including mypac.pos): every
+    /// remaining step is worth at most maxStepValue, and the route can gain at most one super pellet.
+    /// The next Board::massRadius steps also stay within that many of the route's last tile, so together they are
+    /// worth at most the pellet mass around it.
+    double remainingRewardBound(const Route& route, int pathSize, const TurnDiscounts& turns, double maxStepValue, bool superPelletsLeft) {
+        bool superPelletAhead = superPelletsLeft && !route.hasSuperPellets();
+        double bound = maxStepValue * turns.remaining[pathSize];
+        if (superPelletAhead) {
+            bound += 10 * turns.discount[pathSize];
+        }
+        if (board.pelletMass.empty()) return bound;     // Field skipped by the precompute budget.
+
+        int after = pathSize + Board::massRadius;
+        if (after > turns.maxTiles) {
+            return min(bound, board.pelletMassWithin(route.fullPath.back(), turns.maxTiles + 1 - pathSize) * turns.discount[pathSize]);
+        }
+        double massBound = board.pelletMassWithin(route.fullPath.back(), Board::massRadius) * turns.discount[pathSize]
+                           + maxStepValue * turns.remaining[after];
+        if (superPelletAhead) {
+            massBound += 10 * turns.discount[after];
+        }
+        return min(bound, massBound);
+    }
+
+    /// What is left of last step's route from where mypac is now, scored the way the search would score it.
+    /// Returns nothing when that route went stale: we left it, no pellets are left on it, a teammate claimed its
+    /// pellet or first step, or a pac or danger now blocks it.
+    optional<Route> warmStartRoute(Pacman& mypac, int N) {
+        const TilePath& prevPath = mypac.prevRoute.fullPath;
+        if (prevPath.empty()) return nullopt;
+
+        TurnDiscounts turns = turnDiscountsFor(mypac, N);
+        Route route;
+        route.fullPath.push_back(mypac.pos);
+        route.horizon = N;
+        for (auto it = prevPath.begin(); it != prevPath.end() && int(route.fullPath.size()) <= turns.maxTiles; ++it) {
+            Tile* tile = *it;
+            route.fullPath.push_back(tile);
+            bool stop = false;
+            double reward = stepReward(route, mypac, stop);
+            if (stop) return nullopt;
+            route.totalReward += reward * turns.discount[route.fullPath.size()-1] * route.rewardModifier;
+            if (!route.firstPelletTile && tile->getPelletValueAdjusted() > 0) {
+                route.firstPelletTile = tile;
+            }
+        }
+        if (!route.firstPelletTile || tileClaimedByPac(route.firstPelletTile, mypac)) return nullopt;
+        if (isAnyPacsFirstStep(route.fullPath[1], mypac)) return nullopt;
+
+        route.fullPath.eraseFront();
+        return route;
+    }
+
+    /// Tiles that teammates already chose to walk over this step are worth half to mypac, as super pellets that another
+    /// pac goes for are in the search. Takes that half off every candidate route in one batch, weighted the way the
+    /// search weighed each step: discounted, and by the route's rewardModifier there.
+    void rescoreForTeammateRoutes(Pacman& mypac, pmr::vector<Route>& routes) {
+
+        int padId = board.numTiles();
+        pmr::vector<float> sharedValue(padId + 1, 0.0f, SearchArena::resource());
+        bool anyShared = false;
+        for (auto& [_, teammate] : teamOf(mypac)) {
+            for (Tile* tile : plannedRouteOf(teammate, mypac).fullPath) {
+                if (tile->getPelletValueAdjusted() < 10) {  // Super pellets are already taken care of.
+                    sharedValue[tile->id] = 0.5 * tile->getPelletValueAdjusted();
+                    anyShared = true;
+                }
+            }
+        }
+        if (!anyShared || routes.empty()) return;
+
+        TurnDiscounts turns = turnDiscountsFor(mypac, TilePath::capacity);
+        pmr::vector<array<float, TilePath::capacity>> stepWeights(routes.size(), SearchArena::resource());
+        for (int r = 0; r < int(routes.size()); r++) {
+            const TilePath& path = routes[r].fullPath;   // fullPath[k] is the (k+1)-th tile after mypac.pos.
+            double modifier = 1.0;
+            const Tile* prevTile = mypac.pos;
+            for (int k = 0; k < path.size(); k++) {
+                modifier = nextRewardModifier(modifier, prevTile, path[k], k + 2, mypac);
+                stepWeights[r][k] = turns.discount[k + 1] * modifier;
+                prevTile = path[k];
+            }
+        }
+
+        RouteBatch batch(routes, padId, stepWeights);
+        pmr::vector<float> lost(batch.paddedSize(), SearchArena::resource());
+        batch.score(sharedValue.data(), lost.data());
+        for (int r = 0; r < int(routes.size()); r++) {
+            routes[r].totalReward -= lost[r];
+        }
     }
 
+#ifdef PACMAN_THREADS
+    /// extendPathIntoRouteOfN for each of the frontier targets as a task of its own, all pruning against the
+    /// routeCandidates-th best reward any of them found so far, which is where topRoutes would start dropping routes.
+    /// Those are raw rewards, so a route that only the teammate rescoring would have kept may be pruned; the serial
+    /// build prunes against the warm start only.
+    /// Routes keep their tiles inline, so they cross threads as they are.
+    void searchPathsInParallel(const Frontier& frontier, int N, Pacman& mypac, SearchLimits& limits, TopRoutes& topRoutes) {
+        int n = frontier.targets.size();
+        SharedTopRewards sharedTop(routeCandidates, limits.pruneBelow);
+        vector<vector<Route>> found(n);
+        vector<SearchLimits> taskLimits(n, limits);
+        for (SearchLimits& task : taskLimits) task.maxNodes = max(1, planNodeBudget / n);
+        vector<Path> paths;     // In this thread's arena: the tasks only read them.
+        for (int target : frontier.targets) paths.push_back(pathTo(frontier, target));
+        pool->parallelFor(n, [&](int i) {
+            onThreadArena([&] {
+                taskLimits[i].sharedTop = &sharedTop;
+                taskLimits[i].nodesExpanded = taskLimits[i].nodesPruned = 0;
+                taskLimits[i].tableProbes = taskLimits[i].tableHits = 0;
+                TopRoutes routes(routeCandidates);
+                extendPathIntoRouteOfN(paths[i], N, mypac, taskLimits[i], routes);
+                for (Route& route : routes.takeSorted()) found[i].push_back(move(route));
+            });
+        });
+        for (int i = 0; i < n; i++) {
+            limits.nodesExpanded += taskLimits[i].nodesExpanded;
+            limits.nodesPruned += taskLimits[i].nodesPruned;
+            limits.tableProbes += taskLimits[i].tableProbes;
+            limits.tableHits += taskLimits[i].tableHits;
+            for (Route& route : found[i]) topRoutes.offer(move(route));
+        }
+    }
+#endif
 
-    /// Extend given path upto total N nodes by using BFS from the end of given path.
+    /// Extend given path upto N turns ahead (two tiles a turn while sped up) by using DFS from the end of given path.
     /// Select best path beyond end of given path some reward system accumulated value in M nodes. Use discounted rewards.
     /// Goal Criteria: m additional steps or dead end.
-    vector<Route> extendPathIntoRouteOfN(const Path& startingPath, int N, Pacman& mypac) {
+    /// limits caps the number of nodes and prunes routes that cannot beat an incumbent; the node counts are added to it.
+    /// With a table in limits, a state already searched is pruned by what was found below it rather than by a bound,
+    /// and when limits.onlyBest, is not searched again: only its best way on is followed.
+    /// Finished routes are offered to routes, which keeps only the best ones.
+    void extendPathIntoRouteOfN(const Path& startingPath, int N, Pacman& mypac, SearchLimits& limits, TopRoutes& routes) {
 
-        vector<Route> routes;
-        if (startingPath.empty()) return routes;
+        if (startingPath.empty()) return;
+        TurnDiscounts turns = turnDiscountsFor(mypac, N);
 
-        int M = N - startingPath.size();    // M tiles more to add to the path beyond firstPelletTile.
+        int M = turns.maxTiles - startingPath.size();    // M tiles more to add to the path beyond firstPelletTile.
 
         if (M <= 0) {   // Given path is already long enough. No need to extend it more. Just convert it to route.
             Route route;
-            route.pathUptoFirstPellet = startingPath;
-            route.fullPath = startingPath;
+            route.fullPath = TilePath(startingPath.begin(), startingPath.begin() + turns.maxTiles);  // Rewards only count up to the horizon anyway.
             route.firstPelletTile = startingPath.back();
             route.horizon = N; // Later, total route reward will be calculated till cutoff.
 
-            routes.push_back(move(route));
-            return routes;
+            routes.offer(move(route));
+            return;
         }
 
 
-        {
-            // Exhaustive Search:
-            double gamma = 0.88;    // Discount factor
-
-            Route startingRoute;
-            startingRoute.pathUptoFirstPellet = startingPath;
-            startingRoute.fullPath = startingPath;
-            startingRoute.fullPath.insert(startingRoute.fullPath.begin(), mypac.pos);   // Since my Path does not include it.
-            startingRoute.firstPelletTile = startingPath.back();
-            startingRoute.horizon = N;
-
-            queue<Route> q;
-            q.push(startingRoute);
-
-            while (!q.empty()) {
-
-                Route currRoute = q.front(); q.pop();
-                Path& currPath = currRoute.fullPath;
-                int pathSize = currPath.size();
-                Tile* currTile = currPath.back();
-                Tile* prevTile = currPath[currPath.size()-2];
-                bool goalCondition = false;
-
-                //// PROCESS THIS TILE and decide reward & termination condition.
-                double reward = 0.0;
-
-                /// Pellet Reward is gonna be:
-                //  (2*pelletValue - 1) discounted
-                // Problem with this reward calculation:
-                //  - It prefers longer routes of pellets over shorter routes,.. so when N is high like 20, it will deliberately take a longer path through a super pellet
-                //  - There is not enough reward for the close-ness of a super pellet on the path.
-                //  See https://www.codingame.com/share-replay/465045001
-                if (currTile->pelletValue == 10 && currRoute.hasSuperPellets()) {
-                    reward = 0; //  To address above problem. Fixed: https://www.codingame.com/share-replay/465070869
-                }
-                else {
-                    // If some other pacman has this SuperPellet on its route, then reduce reward for this.
-                    bool otherPacGoingForIt = false;
-                    for (auto& [_, pac] : myPacs) {
-                        if (!pac.route.empty()) {
-                            auto& vec = pac.route.superPellets;
-                            if (find(vec.begin(), vec.end(), currTile) != vec.end()) {
-                                otherPacGoingForIt = true;
-                            }
-                        }
-                    }
-                    if (otherPacGoingForIt) reward = 0.5*currTile->getPelletValueAdjusted();
-                    else reward = currTile->getPelletValueAdjusted();
-                }
+        // Exhaustive Search, depth first so that every state is done with before the search leaves it and the table
+        // can keep what was found below it:
+        RouteSearch search{startingPath, turns, mypac, limits, routes};
+        search.pruning = limits.hasIncumbent();
+        search.maxStepValue = search.pruning ? maxRegularStepValue() : 0;
+        search.superPelletsLeft = any_of(board.superPelletTiles.begin(), board.superPelletTiles.end(), [](Tile* t) { return t->pelletValue == 10; });
 
-                ///
-                // if(i == 0 && tile->pacOnTile) {   // TODO: Think about this more.
-                //     reward += 10;   // Reward for kill.
-                // }
+        Route startingRoute;
+        startingRoute.fullPath.push_back(mypac.pos);   // Since my Path does not include it.
+        for (Tile* tile : startingPath) startingRoute.fullPath.push_back(tile);
+        startingRoute.firstPelletTile = startingPath.back();
+        startingRoute.horizon = N;
 
-                if (currTile->getPelletValueAdjusted() == 10) {
-                    currRoute.superPellets.push_back(currTile);
-                }
+        searchRoute(search, startingRoute, limits.maxNodes);
+        limits.nodesExpanded += search.nodes;
+    }
 
-                if (currRoute.rewardModifier != 1.0 && prevTile && prevTile->neighbours.size() > 2) {
-                    currRoute.rewardModifier = 1.0;
-                }
+    /// What stays the same over one run of extendPathIntoRouteOfN.
+    struct RouteSearch {
+        const Path& startingPath;
+        const TurnDiscounts& turns;
+        Pacman& mypac;
+        SearchLimits& limits;
+        TopRoutes& routes;
+        bool pruning = false;
+        double maxStepValue = 0;
+        bool superPelletsLeft = false;
+        int nodes = 0;
+    };
 
-                /// Todo In exhaustive search,.. If a tile has pac on it, end path there if that tile has only 2 neighbours;
-                // regardless of whether it’s my other pac or enemy pac.
-                // If it has 3 neighbours then somehow half all subsequent rewards if enemy pac. If it’s my pac and it has decided a route already,
-                // check its next step and cut off path at its next step.
-                if (currTile->pacOnTile && currTile->pacOnTile != &mypac) {
-                    Pacman* otherPac = currTile->pacOnTile;
+    /// The most a route search found below a state, and how far to trust it.
+    struct SearchOutcome {
+        enum Kind { exact, upperBound, cutShort };  // cutShort: the node budget ran out, so it is neither.
+        double value;
+        Kind kind;
+    };
 
-                    if (otherPac->mine) {
-                        goalCondition = goalCondition || true;
-                    }
-                    else {
-                        currRoute.enemyPacsOnRoute.push_back(otherPac);
+    /// Key of the state the route search is in after scoring the last tile of route: that tile, how far along the
+    /// route it is, the reward modifier, whether a super pellet is on the route, and the tiles already on the route
+    /// that are close enough to be stepped on again in the steps left. Nothing else changes what can be found below.
+    uint64_t routeStateKey(const Route& route, int stepsLeft) {
+        Tile* currTile = route.fullPath.back();
+        uint64_t key = zobrist(currTile->id, 0) ^ zobrist(route.fullPath.size(), 1)
+                       ^ zobrist(int(route.rewardModifier * 2), 2) ^ zobrist(route.hasSuperPellets(), 3);
+        for (Tile* tile : route.fullPath) {
+            if (board.distance(currTile, tile) <= stepsLeft) {
+                key ^= zobrist(tile->id, 4);
+            }
+        }
+        return key;
+    }
 
-                        if (pathSize == 2 || pathSize == 3) {                            
-                            if (typeWeakAgainst.at(otherPac->typeId) == mypac.typeId) { // I'm weak against them. So dont go to/beyond this node.
-                                reward += -100;
-                                goalCondition = goalCondition || true;
-                            }
-                            else if (typeStrongAgainst.at(otherPac->typeId) == mypac.typeId) {
-                                // It's fine; we may eat them. nothing to do in this if-case.
-                                // Actually, no. They can transform in that turn and we'll be dead. It depends:
-                                if (otherPac->abilityCooldown == 0) {
-                                    reward += -100;
-                                    goalCondition = goalCondition || true;
-                                }
-                                else if (otherPac->speedTurnsLeft == 0 && pathSize == 2) {
-                                    // We can definitely eat them right now
-                                    reward += 100;
-                                }
-                            }             
-                        }
+    /// Offers a route the search is done with.
+    void offerRoute(RouteSearch& search, Route& route) {
+        route.fullPath.eraseFront();   // Remove the mypac.pos tile; since that's how I've structured other code.
+#ifdef PACMAN_THREADS
+        if (search.limits.sharedTop) search.limits.sharedTop->offer(route.totalReward);
+#endif
+        search.routes.offer(move(route));
+    }
 
-                        if (currTile->neighbours.size() == 2) {
-                            currRoute.rewardModifier = 0; // This means, 0 rewards beyond enemy pac,.. until we'll reset it when there are > 2 neighbours of currTile.
-                        }
-                        else if (currTile->neighbours.size() > 2) {
-                            currRoute.rewardModifier = 0.5;
-                        }
-                        if (otherPac->speedTurnsLeft == 0 && pathSize == 2) {   // Same case as above-mentioned for definitely killing opponent.
-                            currRoute.rewardModifier = 1.0; 
-                        }
+    /// The most a route of pathSize tiles (including mypac.pos) can gain by walking into the pocket next. Every step
+    /// earns at most its tile's adjusted pellet value; a linear pocket is walked in order, anything else is taken as
+    /// all of it on the first step.
+    double pocketRewardBound(const Board::Pocket& pocket, int pathSize, const TurnDiscounts& turns) {
+        if (!pocket.linear) return pocket.value * turns.discount[pathSize];
+        double most = 0;
+        for (int k = pathSize, d = 0; k <= turns.maxTiles && d < int(pocket.tiles.size()); k++, d++) {
+            most += board.tileById[pocket.tiles[d]]->getPelletValueAdjusted() * turns.discount[k];
+        }
+        return most;
+    }
 
-                    }
+    /// Walks route from the exit of a linear pocket to its dead end, or as far as the horizon or nodeLimit allow, and
+    /// offers it. There is one way through, so the tiles are scored in order without searching. Returns what they add
+    /// to route.totalReward.
+    SearchOutcome walkLinearPocket(RouteSearch& search, Route& route, const Board::Pocket& pocket, int nodeLimit) {
+        double rewardBefore = route.totalReward;
+        SearchOutcome::Kind kind = SearchOutcome::exact;
+        for (int id : pocket.tiles) {   // Entrance first, then one step deeper each.
+            route.fullPath.push_back(board.tileById[id]);
+            int pathSize = route.fullPath.size();
+            if (search.turns.endsTurn[pathSize-1]) search.nodes++;
+            bool stop = false;
+            double reward = stepReward(route, search.mypac, stop);
+            route.totalReward += reward * search.turns.discount[pathSize-1] * route.rewardModifier;
+            if (stop || pathSize == search.turns.maxTiles+1) break;
+            if (search.nodes >= nodeLimit) {
+                kind = SearchOutcome::cutShort;
+                break;
+            }
+        }
+        offerRoute(search, route);
+        return {route.totalReward - rewardBefore, kind};
+    }
 
-                }
+    /// How many of nodesLeft route search nodes the first of numWays ways to search (frontier paths, or ways on from a
+    /// tile) may use, the others getting what it leaves. 1/laterWayShare of them is held back for each of the others,
+    /// but no more than half, so that running out cuts all of them short rather than leaving the last ones unsearched.
+    /// (An even split cut deep routes in open areas long before the budget ran out, and lost games.)
+    int nodesForFirstOf(int numWays, int nodesLeft) {
+        return nodesLeft - min(nodesLeft / 2, (numWays - 1) * (nodesLeft / laterWayShare));
+    }
+
+    /// Scores the last tile of currRoute, then searches every way to extend it, offering finished routes to
+    /// search.routes. Returns the most the last tile and the steps after it add to currRoute.totalReward.
+    /// Once search.nodes reaches nodeLimit, routes are offered as they are; the ways on share what is left of it.
+    SearchOutcome searchRoute(RouteSearch& search, Route& currRoute, int nodeLimit) {
+        SearchLimits& limits = search.limits;
+        TilePath& currPath = currRoute.fullPath;
+        int pathSize = currPath.size();
+        if (search.turns.endsTurn[pathSize-1]) search.nodes++;     // Nodes are turns: two tiles while sped up.
+        Tile* currTile = currPath.back();
+        Tile* prevTile = currPath[pathSize-2];
+        bool goalCondition = false;
+
+        double rewardBefore = currRoute.totalReward;
+        double reward = stepReward(currRoute, search.mypac, goalCondition);
+        currRoute.totalReward += reward * search.turns.discount[pathSize-1] * currRoute.rewardModifier;
+        double gain = currRoute.totalReward - rewardBefore;
+
+        // GOAL CRITERION:
+        goalCondition = goalCondition || pathSize == search.turns.maxTiles+1 || ( currTile->neighbours.size() == 1 && currTile->neighbours[0] == prevTile);
+        bool outOfNodes = search.nodes >= nodeLimit;
+        if (goalCondition || outOfNodes) {
+            offerRoute(search, currRoute);
+            return {gain, outOfNodes ? SearchOutcome::cutShort : SearchOutcome::exact};
+        }
 
-                currRoute.totalReward += reward * pow(gamma, pathSize-1) * currRoute.rewardModifier;
+        if (search.pruning) {
+            double bound = remainingRewardBound(currRoute, pathSize, search.turns, search.maxStepValue, search.superPelletsLeft);
+            if (currRoute.totalReward + bound <= limits.incumbent()) {
+                limits.nodesPruned++;   // Even all pellets from here on would not beat the incumbent.
+                return {gain + bound, SearchOutcome::upperBound};
+            }
+        }
 
-                // GOAL CRITERION:
-                goalCondition = goalCondition || currPath.size() == N+1 || ( currTile->neighbours.size() == 1 && currTile->neighbours[0] == prevTile);
-                if(goalCondition) {
-                    currRoute.fullPath.erase(currRoute.fullPath.begin());   // Remove the mypac.pos tile; since that's how I've structured other code.
-                    routes.push_back(move(currRoute));
+        int stepsLeft = search.turns.maxTiles+1 - pathSize;
+        uint64_t key = 0;
+        // Otherwise the table can only prune, and all routes below a state stay candidates. It is only worth the key
+        // for states with a lot below them.
+        bool useTable = limits.table && (search.pruning || limits.onlyBest) && stepsLeft >= minTableSteps;
+        if (useTable) {
+            key = routeStateKey(currRoute, stepsLeft);
+            limits.tableProbes++;
+            if (optional<TranspositionTable::Entry> entry = limits.table->probe(key, limits.generation)) {
+                SearchOutcome::Kind kind = entry->exact ? SearchOutcome::exact : SearchOutcome::upperBound;
+                if (search.pruning && currRoute.totalReward + entry->value <= limits.incumbent()) {
+                    limits.tableHits++;
+                    limits.nodesPruned++;   // What was found below this state before does not beat the incumbent either.
+                    return {gain + entry->value, kind};
                 }
-                else { // currTile on path has neighbours other than the parent.
-                    for (Tile* neighbour : currTile->neighbours) {
-                        if (find(currPath.begin(), currPath.end(), neighbour) == currPath.end()) {  // Add it if it's not already on the current path
-                            Route tempRoute = currRoute;
-                            tempRoute.fullPath.push_back(neighbour);
-                            q.push(move(tempRoute));
-                        }
+                if (limits.onlyBest && entry->exact) {
+                    limits.tableHits++;
+                    if (entry->bestNext == TranspositionTable::noTile) {
+                        if (entry->value == 0) offerRoute(search, currRoute);  // It ended at an empty dead end.
+                        return {gain + entry->value, kind};
                     }
+                    currRoute.fullPath.push_back(board.tileById[entry->bestNext]);
+                    SearchOutcome below = searchRoute(search, currRoute, nodeLimit);
+                    return {gain + below.value, below.kind};
                 }
-
             }
+        }
 
-        }  // End Search.
-
-        return routes;
+        // currTile on path has neighbours other than the parent.
+        SearchOutcome best{-numeric_limits<double>::infinity(), SearchOutcome::exact};
+        int bestNext = TranspositionTable::noTile;
+        bool inCorridor = board.inCorridor(currTile);   // At most one way on, which can have currRoute itself.
+        bool skippedEmptyPocket = false;
+        array<pair<Tile*, const Board::Pocket*>, 4> ways;
+        int numWays = 0;
+        for (Tile* neighbour : currTile->neighbours) {
+            if (currPath.contains(neighbour)) continue;  // Add it if it's not already on the current path
+
+            // A dead end is scored as a whole before walking into it: if nothing is in reach in there, the route
+            // ends here instead. (Pruning the ones that cannot beat the incumbent lost games: routes are rescored
+            // for teammates after the search, so the incumbent is not final.)
+            const Board::Pocket* pocket = board.pocketEnteredBy(currTile, neighbour);
+            if (pocket && pocketRewardBound(*pocket, pathSize, search.turns) <= 0) {
+                skippedEmptyPocket = true;
+                continue;
+            }
+            ways[numWays++] = {neighbour, pocket};
+        }
+        for (int w = 0; w < numWays; w++) {
+            auto [neighbour, pocket] = ways[w];
+            int wayLimit = search.nodes + nodesForFirstOf(numWays - w, nodeLimit - search.nodes);
+
+            Route nextRoute;
+            Route& next = inCorridor ? currRoute : (nextRoute = currRoute);
+            SearchOutcome below;
+            if (pocket && pocket->linear) {
+                below = walkLinearPocket(search, next, *pocket, wayLimit);
+            }
+            else {
+                next.fullPath.push_back(neighbour);
+                below = searchRoute(search, next, wayLimit);
+            }
+            if (below.value > best.value) {
+                best.value = below.value;
+                bestNext = neighbour->id;
+            }
+            best.kind = max(best.kind, below.kind);
+            if (inCorridor) break;  // currRoute is gone.
+        }
+        if (skippedEmptyPocket) {
+            if (best.value < 0) {
+                best.value = 0;
+                bestNext = TranspositionTable::noTile;
+            }
+            offerRoute(search, currRoute);
+        }
+        if (useTable && best.kind != SearchOutcome::cutShort) {
+            limits.table->store(key, limits.generation, stepsLeft, {best.value, best.kind == SearchOutcome::exact, bestNext});
+        }
+        return {gain + best.value, best.kind};
     }
 
 
@@ -1189,7 +4078,6 @@ public:
     // For high N like 20, nearly everything would be considered as a dead end; so not good.
     void calculateRouteReward2(Route& route, Pacman& pac) {
         double totalReward = 0;
-        double gamma = 0.88;
         int N = route.horizon;
 
         bool isDeadend = route.fullPath.size() < N;
@@ -1222,7 +4110,7 @@ public:
                 totalReward += reward;      // TUNE: Dont discount rewards if going into deadend ??
             }
             else {
-                totalReward += reward * pow(gamma, stepCount);
+                totalReward += reward * RoutePolicy::discount(stepCount);
             }
             i++; stepCount++;
         }
@@ -1231,7 +4119,7 @@ public:
             // We gotta walk back to starting position now.
             // So:
             while (i > 0) {
-                totalReward  += (-1) * pow(gamma, stepCount);
+                totalReward  += (-1) * RoutePolicy::discount(stepCount);
                 i--; stepCount++;
             }
         }
@@ -1254,7 +4142,6 @@ public:
 
     void calculateRouteReward3(Route& route, Pacman& pac) {
         double totalReward = 0;
-        double gamma = 0.88;
         int N = route.horizon;
 
         // Reward is gonna be:
@@ -1275,7 +4162,7 @@ public:
             //      Commented out coz this is a bad idea. We end up losing pellets.
             // }
 
-            totalReward += reward * pow(gamma, stepCount);
+            totalReward += reward * RoutePolicy::discount(stepCount);
             i++; stepCount++;
         }
 
@@ -1303,6 +4190,12 @@ public:
         cmd << command;
     }
 
+    /// What a pac adds to pacHash.
+    static uint64_t pacKey(const Pacman& pac) {
+        uint64_t slot = pac.pacId * 2 + pac.mine;
+        return zobrist(slot << 16 | pac.pos->id, 6) ^ zobrist((slot << 8 | pac.speedTurnsLeft) << 2 | (typeIndex(pac.typeId) + 1), 7);
+    }
+
     void input() {
 
         cin >> this->myScore >> this->opponentScore; cin.ignore();
@@ -1324,11 +4217,15 @@ public:
 
             auto& pacsContainer = (mine) ? ( (typeId != "DEAD")? this->myPacs : this->myDeadPacs ) : ( (typeId != "DEAD")? this->theirPacs : this->theirDeadPacs );
 
-            if (pacsContainer.count(pacId) == 0) {
+            bool known = pacsContainer.count(pacId) != 0;
+            if (!known) {
                 pacsContainer.emplace(pacId, Pacman(pacId, mine, pos, typeId, speedTurnsLeft, abilityCooldown, this->board));
             }
 
             Pacman& pac = pacsContainer.at(pacId);
+            if (known && typeId != "DEAD") {
+                pacHash ^= pacKey(pac);     // Out with the old state; the new one goes in below.
+            }
             if (pac.pos->pacOnTile == &pac) {
                 pac.pos = nullptr;  // Reset old position's pac unless it was inputted newly as a different pac.
             }
@@ -1337,34 +4234,46 @@ public:
             pac.speedTurnsLeft = speedTurnsLeft;
             pac.abilityCooldown = abilityCooldown;
             pac.visible = true;
+            pac.lastSeenStep = gameSteps;
             pac.pos->enemyPacOnTileExpiry = 3;  // When the enemy pac goes out of sight, it will be remembered to be here for 3 game steps.
 
             if (typeId != "DEAD") { // Link only Alive pacs to tiles.
                 pos->pacOnTile = &pac;
+                pacHash ^= pacKey(pac);
             }
             else {
                 // Delete dead pacs from alive container.
                 auto& alivePacsContainer = (mine) ? this->myPacs : this->theirPacs;
+                auto alive = alivePacsContainer.find(pacId);
+                if (alive != alivePacsContainer.end()) {
+                    pacHash ^= pacKey(alive->second);
+                    // Don't leave any tile pointing to the erased pac. Enemy pacs can be remembered on more than one tile.
+                    for (Tile* tile : board.tileById) {
+                        if (tile->pacOnTile == &alive->second) {
+                            tile->pacOnTile = nullptr;
+                        }
+                    }
+                }
                 alivePacsContainer.erase(pacId);
             }
         }
 
-        this->clearPellets();
-
         // Input Pellets:
         cin >> this->visiblePelletCount; cin.ignore();
         cerr << "Input SuperPellets: ";
+        vector<pair<Tile*, int>> visiblePellets;
         for (int i = 0; i < this->visiblePelletCount; i++) {
             int x, y, value;
             cin >> x >> y >> value; cin.ignore();
             // cerr << "Input Pellet: " << x << " " << y << " " << value << endl;
-            this->board.tiles.at({x,y}).pelletValue = value;
+            visiblePellets.emplace_back(&this->board.tiles.at({x,y}), value);
             if (value == 10) {
                 board.superPelletTiles.insert(&this->board.tiles.at({x,y}));
                 cerr << "<" << x << "," << y << "> ";
             }
         }
         cerr << endl;
+        this->updatePellets(visiblePellets);
     }
 
     void update() {
@@ -1380,12 +4289,14 @@ public:
 
         this->updateGonePelletsBasedOnEnemyPacLocation();
 
+        this->applySymmetryInference();
+
+        this->updateEnemyBeliefs();
+
         // Update things related to unknown pellets:
         this->board.updateNumUnknownPellets();
 
-        int numMyPacsTotal = myPacs.size() + myDeadPacs.size();
-        int numOpponentAliveInvisiblePacs = numMyPacsTotal - theirDeadPacs.size() - theirVisiblePacs.size();
-        this->board.updatePelletAdjustValues(numOpponentAliveInvisiblePacs);
+        this->board.updatePelletAdjustValues(beliefs.occupancy);
 
         this->board.sortTileNeighboursByPelletValues();
 
@@ -1409,6 +4320,7 @@ int main()
     cerr << "Building board..." << endl;
     game.buildBoard(grid);
     cerr << "Built board" << endl;
+    game.precompute(grid);
 
 
     // game loop